@@ -0,0 +1,166 @@
+/*
+ * 19 Oct 2026
+ * Write and read checkpoints. The file is
+ *   - eight bytes "RDCKPT1\n"
+ *   - the length of the key as a 64 bit integer and the key
+ *   - whatever the caller writes
+ *   - eight bytes "RDCKEND\n", so we know it is all there.
+ * Input files are recognised by their size, modification time
+ * and a hash of their first and last megabyte, which is much
+ * quicker than reading them.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "bust.hh"
+#include "ckpt.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const char CKPT_MAGIC[8] = {'R', 'D', 'C', 'K', 'P', 'T', '1', '\n'};
+static const char CKPT_END[8]   = {'R', 'D', 'C', 'K', 'E', 'N', 'D', '\n'};
+static const size_t FINGER_BYTES = 1 << 20;  /* hashed from each end */
+static const uint64_t MAX_KEY_LEN = 1 << 20;
+
+/* ---------------- fnv_add ----------------------------------
+ * 64 bit FNV-1a hash of a buffer, starting from h.
+ */
+static uint64_t
+fnv_add (uint64_t h, const char *p, const size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* ---------------- file_finger ------------------------------
+ * Something which changes if the file changes. Empty if we
+ * cannot look at the file.
+ */
+string
+file_finger (const char *fname)
+{
+    struct stat st;
+    if (stat (fname, &st) != 0)
+        return string();
+    ifstream infile (fname, ios::binary);
+    if (!infile)
+        return string();
+    const size_t size = size_t (st.st_size);
+    const size_t n_head = size < FINGER_BYTES ? size : FINGER_BYTES;
+    vector<char> buf (n_head);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    infile.read (buf.data(), streamsize (n_head));
+    h = fnv_add (h, buf.data(), size_t (infile.gcount()));
+    if (size > n_head) {
+        const size_t n_tail = (size - n_head) < FINGER_BYTES ? (size - n_head) : FINGER_BYTES;
+        infile.seekg (streamoff (size - n_tail));
+        buf.resize (n_tail);
+        infile.read (buf.data(), streamsize (n_tail));
+        h = fnv_add (h, buf.data(), size_t (infile.gcount()));
+    }
+    ostringstream o;
+    o << fname << ' ' << size << ' ' << st.st_mtime << ' ' << hex << h;
+    return o.str();
+}
+
+/* ---------------- ckpt_write ------------------------------- */
+int
+ckpt_write (const char *dir, const char *name, const string &key,
+            const function<int (ostream &)> &body)
+{
+    const string path = string (dir) + '/' + name;
+    const string tmp = path + ".tmp";
+    ofstream outfile (tmp, ios::binary);
+    if (!outfile)
+        return (bust (__func__, "Open fail for writing on", tmp.c_str(), ": ", strerror(errno), 0));
+    const uint64_t len = key.size();
+    outfile.write (CKPT_MAGIC, sizeof (CKPT_MAGIC));
+    outfile.write ((const char *) &len, sizeof (len));
+    outfile.write (key.data(), streamsize (len));
+    if (body (outfile) != EXIT_SUCCESS)
+        return (bust (__func__, "failed writing", tmp.c_str(), 0));
+    outfile.write (CKPT_END, sizeof (CKPT_END));
+    outfile.close();
+    if (outfile.fail())
+        return (bust (__func__, "Error writing to", tmp.c_str(), 0));
+    if (rename (tmp.c_str(), path.c_str()) != 0)
+        return (bust (__func__, "renaming", tmp.c_str(), "to", path.c_str(), ":", strerror(errno), 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- get_key ----------------------------------
+ * Read the start of a checkpoint, up to the end of its key.
+ */
+static bool
+get_key (istream &infile, const string &path, string &key)
+{
+    char magic [sizeof (CKPT_MAGIC)];
+    uint64_t len = 0;
+    infile.read (magic, sizeof (magic));
+    infile.read ((char *) &len, sizeof (len));
+    if (!infile || memcmp (magic, CKPT_MAGIC, sizeof (magic)) != 0 || len > MAX_KEY_LEN) {
+        cerr << __func__ << ": " << path << " is not a checkpoint. Ignoring it.\n";
+        return false;
+    }
+    key.assign (len, '\0');
+    infile.read (&key[0], streamsize (len));
+    return bool (infile);
+}
+
+/* ---------------- ckpt_key ---------------------------------
+ * Only look at the key, so we can tell what a checkpoint from
+ * somebody else was made from.
+ */
+bool
+ckpt_key (const char *dir, const char *name, string &key)
+{
+    const string path = string (dir) + '/' + name;
+    ifstream infile (path, ios::binary);
+    if (!infile)
+        return false;
+    return (get_key (infile, path, key));
+}
+
+/* ---------------- ckpt_read -------------------------------- */
+bool
+ckpt_read (const char *dir, const char *name, const string &key,
+           const function<int (istream &)> &body)
+{
+    const string path = string (dir) + '/' + name;
+    ifstream infile (path, ios::binary);
+    if (!infile)
+        return false;
+    char magic [sizeof (CKPT_END)];
+    string old_key;
+    if (!get_key (infile, path, old_key))
+        return false;
+    if (old_key != key) {
+        cout << path << " is from different inputs or options. Not using it.\n";
+        return false;
+    }
+    if (body (infile) != EXIT_SUCCESS) {
+        cerr << __func__ << ": could not read " << path << ". Ignoring it.\n";
+        return false;
+    }
+    infile.read (magic, sizeof (magic));
+    if (!infile || memcmp (magic, CKPT_END, sizeof (magic)) != 0) {
+        cerr << __func__ << ": " << path << " is cut short. Ignoring it.\n";
+        return false;
+    }
+    return true;
+}
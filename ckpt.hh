@@ -0,0 +1,27 @@
+/*
+ * 19 Oct 2026
+ * Checkpoints, so a long run which is stopped can start again
+ * from what it had already done.
+ * Can only be included after <functional>, <iosfwd> and <string>
+ */
+#ifndef CKPT_HH
+#define CKPT_HH
+
+/* ---------------- checkpoints ------------------------------
+ * A checkpoint is a file, name, in a directory. It starts with a
+ * key, which should say which inputs (see file_finger()) and
+ * options it came from. body writes or reads the rest.
+ * ckpt_write() writes to a temporary file and renames it, so
+ * there is never half a checkpoint under the real name.
+ * ckpt_read() returns true only if the file is there, has the
+ * same key and body read all of it. ckpt_key() only gets the
+ * key, so one checkpoint can be read by a run with other inputs.
+ */
+std::string file_finger (const char *fname);
+int ckpt_write (const char *dir, const char *name, const std::string &key,
+                const std::function<int (std::ostream &)> &body);
+bool ckpt_read (const char *dir, const char *name, const std::string &key,
+                const std::function<int (std::istream &)> &body);
+bool ckpt_key (const char *dir, const char *name, std::string &key);
+
+#endif /* CKPT_HH */
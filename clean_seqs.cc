@@ -19,6 +19,7 @@
 #include "regex_prob.hh"
 #include "bust.hh"
 #include "fseq.hh"
+#include "fseq_prop.hh"
 #include "mgetline.hh"
 #include "t_queue.hh"
 using namespace std;
@@ -44,6 +45,8 @@ struct criteria {
     string::size_type max_len;
     float s_arg;  /* These come from the command line */
     float t_arg;  /* Arguments */
+    float max_unknown;    /* fraction of X, B, Z, U. Zero means no limit */
+    float max_commonest;  /* fraction of the most common residue */
 };
 
 struct seq_tag {
@@ -66,7 +69,7 @@ usage ( const char *progname, const char *s)
 {
     static const char *u
         = " [-n -s small_seq -t big_seq -g -i min_len -j max_len] \
-[-k every_k\'th_sequence] \
+[-k every_k\'th_sequence] [-c max_commonest] [-x max_unknown] \
 [-w warning_tags] seq_tags_fname in_file out_file\n";
     bust_void (progname, s, 0);
     return (bust ("Usage", progname, u, 0));
@@ -74,18 +77,26 @@ usage ( const char *progname, const char *s)
 
 /* ---------------- keep_seq  --------------------------------
  * Given a sequence, return true if he is OK to keep, that is,
- * he is not too short or too long.
+ * he is not too short or too long, has not too many unknown
+ * residues and is not too much of one residue.
  */
 static bool
 keep_seq ( fseq &f, const struct criteria *criteria)
 {
-    const string::size_type len = f.get_seq().size();
+    const string::size_type len = f.get_seq_ref().size();
     if (!criteria)
         return true;
     if (criteria->max_len && len > criteria->max_len)
         return false;
     if (criteria->min_len && len < criteria->min_len)
         return false;
+    if (criteria->max_unknown > 0 || criteria->max_commonest > 0) {
+        const fseq_comp f_p (f);
+        if (criteria->max_unknown > 0 && f_p.frac_unknown() > criteria->max_unknown)
+            return false;
+        if (criteria->max_commonest > 0 && f_p.frac_commonest() > criteria->max_commonest)
+            return false;
+    }
     return true;
 }
 
@@ -449,6 +460,33 @@ set_criteria_cmd_ln (struct criteria *criteria, const char *small_seq_str, const
     return EXIT_SUCCESS;
 }
 
+/* ---------------- set_criteria_frac -----------------------
+ * Limits on the fraction of unknown residues and of the most
+ * common residue.
+ */
+static int
+set_criteria_frac (struct criteria *criteria, const char *unknown_str, const char *commonest_str)
+{
+    const char *strs[2] = {unknown_str, commonest_str};
+    float *dst[2] = {&criteria->max_unknown, &criteria->max_commonest};
+    for (unsigned i = 0; i < 2; i++) {
+        if (! strs[i])
+            continue;
+        try {
+            *dst[i] = stof (strs[i]);
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid argument: " << e.what() <<
+                "\nwhen converting "<< strs[i] << " for a fraction of residues\n";
+            return EXIT_FAILURE;
+        }
+        if (*dst[i] <= 0 || *dst[i] > 1) {
+            std::cerr << "A fraction of residues should be above 0 and not above 1, not " << strs[i] << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
 /* ---------------- set_criteria_std_dev --------------------- */
 static int
 set_criteria_std_dev (struct criteria *criteria, const struct stats *stats,
@@ -483,6 +521,8 @@ main (int argc, char *argv[])
                *k_every_str = NULL,
                *min_seq_str = NULL,
                *max_seq_str = NULL,
+               *unknown_str = NULL,
+               *commonest_str = NULL,
                *seq_tags_fname,
                *warn_tags_fname = NULL;
     short unsigned verbosity = 0;
@@ -490,9 +530,10 @@ main (int argc, char *argv[])
           nothing_flag = false,
           eflag = false;
     struct criteria *crit_ptr = NULL;
-    struct criteria criteria = {0, 0, 0, 0};
-    while ((c = getopt(argc, argv, "gi:j:k:ns:t:vw:")) != -1) {
+    struct criteria criteria = {0, 0, 0, 0, 0, 0};
+    while ((c = getopt(argc, argv, "c:gi:j:k:ns:t:vw:x:")) != -1) {
         switch (c) {
+        case 'c': commonest_str   = optarg;                            break;
         case 'g': keep_gap = true;                                     break;
         case 'n': nothing_flag    = true;                              break;
         case 'i': min_seq_str     = optarg;                            break;
@@ -502,6 +543,7 @@ main (int argc, char *argv[])
         case 't': big_seq_str     = optarg;                            break;
         case 'v': verbosity++;                                         break;
         case 'w': warn_tags_fname = optarg;                            break;
+        case 'x': unknown_str     = optarg;                            break;
         case ':':
             cerr << argv[0] << " Missing opt argument\n"; eflag = true; break;
         case '?':
@@ -523,6 +565,11 @@ main (int argc, char *argv[])
             return EXIT_FAILURE;
         crit_ptr = & criteria; /* Use this later to say if criteria have been set */
     }
+    if (unknown_str || commonest_str) {
+        if (set_criteria_frac (&criteria, unknown_str, commonest_str) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        crit_ptr = & criteria;
+    }
 
     if (k_every_str) {
         try {
@@ -591,6 +638,10 @@ main (int argc, char *argv[])
             cout << "Sequence minimum length to be kept: "<< crit_ptr->min_len<<'\n';
         if (crit_ptr->max_len)
             cout << "Sequence maximum length to be kept: "<< crit_ptr->max_len<<'\n';
+        if (crit_ptr->max_unknown > 0)
+            cout << "Most unknown residues (X, B, Z, U) to be kept: "<< crit_ptr->max_unknown<<'\n';
+        if (crit_ptr->max_commonest > 0)
+            cout << "Most of one residue to be kept: "<< crit_ptr->max_commonest<<'\n';
     }
     cout << "Shortest sequence no. " << stats.ndx_short << ", length "
          << stats.len_short << " starts with\n"
@@ -0,0 +1,339 @@
+/*
+ * 19 Oct 2026
+ * Histogram and quantiles of distances, without keeping or
+ * sorting the distances.
+ * The quantiles come from a merging t-digest (Dunning and Ertl).
+ * Values are sorted into clusters, each with a mean and a weight.
+ * A cluster may only grow while it covers less than one unit of
+ *     k(q) = delta / (2 pi) * asin (2q - 1)
+ * where q is the fraction of the data to its left, so clusters
+ * near the ends of the distribution stay small.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bust.hh"
+#include "dist_stat.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const size_t   MIN_BUF = 4096;          /* values waiting to be merged */
+static const size_t   CHUNK = 1 << 16;         /* values handed to a worker at once */
+static const unsigned DFLT_STAT_THREAD = 2;
+static const double   PI = 3.14159265358979323846;
+
+/* ---------------- dist_stat::dist_stat ---------------------
+ */
+dist_stat::dist_stat (const unsigned n_bin, const double lo_, const double hi_,
+                      const double delta_)
+    : v_bin (n_bin ? n_bin : 1, 0), lo (lo_), hi (hi_), delta (delta_),
+      sum (0.0), n (0), n_below (0), n_above (0), n_nan (0),
+      d_min (numeric_limits<float>::max()), d_max (-numeric_limits<float>::max())
+{
+    bin_scale = (hi > lo) ? double (v_bin.size()) / (hi - lo) : 0.0;
+    v_buf.reserve (max (MIN_BUF, size_t (10 * delta)));
+}
+
+/* ---------------- dist_stat::add --------------------------- */
+void
+dist_stat::add (const float d)
+{
+    if (d != d) {                                   /* NaN */
+        n_nan++;
+        return;
+    }
+    n++;
+    sum += d;
+    if (d < d_min) d_min = d;
+    if (d > d_max) d_max = d;
+    if (d < lo) {
+        n_below++;
+    } else if (d > hi) {
+        n_above++;
+    } else {
+        size_t b = size_t ((d - lo) * bin_scale);
+        if (b >= v_bin.size())                      /* d == hi */
+            b = v_bin.size() - 1;
+        v_bin[b]++;
+    }
+    v_buf.push_back ({d, 1.0});
+    if (v_buf.size() == v_buf.capacity())
+        compress();
+}
+
+/* ---------------- k_scale, k_inv ---------------------------
+ * The scale function and its inverse.
+ */
+static double
+k_scale (const double q, const double delta)
+{
+    return delta / (2 * PI) * asin (2 * q - 1);
+}
+static double
+k_inv (const double k, const double delta)
+{
+    if (k >= delta / 4)
+        return 1.0;
+    return (sin (k * 2 * PI / delta) + 1) / 2;
+}
+
+/* ---------------- dist_stat::compress ----------------------
+ * Merge the buffer into the digest. Everything is sorted by
+ * mean, then swept from the left, growing the current cluster
+ * until it would reach the next unit of k.
+ */
+void
+dist_stat::compress ()
+{
+    if (v_buf.empty())
+        return;
+    v_buf.insert (v_buf.end(), v_cen.begin(), v_cen.end());
+    sort (v_buf.begin(), v_buf.end(),
+          [] (const centroid &a, const centroid &b) { return a.mean < b.mean;});
+    double total = 0.0;
+    for (const centroid &c : v_buf)
+        total += c.w;
+    vector<centroid> v_new;
+    v_new.reserve (size_t (delta) + 1);
+    centroid cur = v_buf[0];
+    double w_so_far = 0.0;
+    double q_limit = k_inv (k_scale (0.0, delta) + 1, delta);
+    for (size_t i = 1; i < v_buf.size(); i++) {
+        const centroid &c = v_buf[i];
+        if ((w_so_far + cur.w + c.w) / total <= q_limit) {
+            cur.w += c.w;
+            cur.mean += (c.mean - cur.mean) * c.w / cur.w;
+        } else {
+            v_new.push_back (cur);
+            w_so_far += cur.w;
+            q_limit = k_inv (k_scale (w_so_far / total, delta) + 1, delta);
+            cur = c;
+        }
+    }
+    v_new.push_back (cur);
+    v_cen.swap (v_new);
+    v_buf.clear();
+}
+
+/* ---------------- dist_stat::merge -------------------------
+ * Add everything from other, which must have the same bins.
+ * other's digest goes in as weighted clusters.
+ */
+int
+dist_stat::merge (dist_stat &other)
+{
+    if (other.v_bin.size() != v_bin.size() || other.lo != lo || other.hi != hi)
+        return (bust (__func__, "programming bug. Histograms have different bins", 0));
+    for (size_t i = 0; i < v_bin.size(); i++)
+        v_bin[i] += other.v_bin[i];
+    n += other.n;
+    n_below += other.n_below;
+    n_above += other.n_above;
+    n_nan += other.n_nan;
+    sum += other.sum;
+    d_min = min (d_min, other.d_min);
+    d_max = max (d_max, other.d_max);
+    other.compress();
+    for (const centroid &c : other.v_cen) {
+        v_buf.push_back (c);
+        if (v_buf.size() == v_buf.capacity())
+            compress();
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- dist_stat::quantile ----------------------
+ * Each cluster has half its weight on either side of its mean.
+ * Interpolate linearly between the means of neighbouring
+ * clusters and between the outer clusters and the extremes.
+ */
+double
+dist_stat::quantile (const double q)
+{
+    if (n == 0)
+        return numeric_limits<double>::quiet_NaN();
+    if (q <= 0.0)
+        return d_min;
+    if (q >= 1.0)
+        return d_max;
+    compress();
+    const double index = q * double (n);
+    const centroid &first = v_cen.front();
+    double x;
+    if (index < first.w / 2) {
+        x = d_min + (first.mean - d_min) * index / (first.w / 2);
+    } else {
+        double cum = first.w / 2;
+        size_t i = 0;
+        for ( ; i + 1 < v_cen.size(); i++) {
+            const double dw = (v_cen[i].w + v_cen[i + 1].w) / 2;
+            if (cum + dw > index)
+                break;
+            cum += dw;
+        }
+        if (i + 1 < v_cen.size()) {
+            const double dw = (v_cen[i].w + v_cen[i + 1].w) / 2;
+            x = v_cen[i].mean + (v_cen[i + 1].mean - v_cen[i].mean) * (index - cum) / dw;
+        } else {
+            const centroid &last = v_cen.back();
+            x = last.mean + (d_max - last.mean) * (index - cum) / (last.w / 2);
+        }
+    }
+    return min (max (x, double (d_min)), double (d_max));
+}
+
+/* ---------------- dist_stat::write_quantiles ---------------
+ */
+void
+dist_stat::write_quantiles (ostream &out, const vector<double> &v_q)
+{
+    for (const double q : v_q)
+        out << setw (8) << q << ' ' << setw (10) << quantile (q) << '\n';
+}
+
+/* ---------------- dist_stat::write_hist --------------------
+ * Bottom and top of each bin, the count and the fraction of all
+ * distances up to the top of the bin.
+ */
+void
+dist_stat::write_hist (ostream &out) const
+{
+    const double width = (hi - lo) / double (v_bin.size());
+    size_t cum = n_below;
+    if (n_below)
+        out << "# " << n_below << " distances below " << lo << '\n';
+    for (size_t i = 0; i < v_bin.size(); i++) {
+        cum += v_bin[i];
+        out << setw (10) << lo + double (i) * width << ' '
+            << setw (10) << lo + double (i + 1) * width << ' '
+            << setw (12) << v_bin[i] << ' '
+            << setw (10) << (n ? double (cum) / double (n) : 0.0) << '\n';
+    }
+    if (n_above)
+        out << "# " << n_above << " distances above " << hi << '\n';
+}
+
+/* ---------------- stat_feed::mailbox -----------------------
+ * Holds at most one chunk on its way to a worker.
+ */
+struct stat_feed::mailbox {
+    mutex mtx;
+    condition_variable cv;
+    vector<float> data;
+    bool full;
+    bool closed;
+    mailbox () : full (false), closed (false) {}
+};
+
+/* ---------------- stat_worker ------------------------------
+ */
+static void
+stat_worker (stat_feed::mailbox *box, dist_stat *stat)
+{
+    vector<float> mine;
+    mine.reserve (CHUNK);
+    for (;;) {
+        {
+            unique_lock<mutex> lock (box->mtx);
+            box->cv.wait (lock, [box] { return box->full || box->closed;});
+            if (! box->full)
+                return;
+            mine.swap (box->data);
+            box->full = false;
+        }
+        box->cv.notify_one();
+        for (const float d : mine)
+            stat->add (d);
+        mine.clear();
+    }
+}
+
+/* ---------------- stat_feed::stat_feed ---------------------
+ */
+stat_feed::stat_feed (dist_stat &d, unsigned n_thread)
+    : dst (&d), next_box (0)
+{
+    if (n_thread == 0)
+        n_thread = DFLT_STAT_THREAD;
+    v_stat.assign (n_thread, d.blank());
+    for (unsigned t = 0; t < n_thread; t++) {
+        v_box.push_back (new mailbox);
+        v_box.back()->data.reserve (CHUNK);
+    }
+    for (unsigned t = 0; t < n_thread; t++)
+        v_thr.push_back (thread (stat_worker, v_box[t], &v_stat[t]));
+    chunk.reserve (CHUNK);
+}
+
+/* ---------------- stat_feed::~stat_feed --------------------
+ * If nobody called finish(), we still have to stop the workers.
+ */
+stat_feed::~stat_feed ()
+{
+    for (mailbox *b : v_box) {
+        {
+            lock_guard<mutex> lock (b->mtx);
+            b->closed = true;
+        }
+        b->cv.notify_one();
+    }
+    for (thread &t : v_thr)
+        if (t.joinable())
+            t.join();
+    for (mailbox *b : v_box)
+        delete b;
+}
+
+/* ---------------- stat_feed::send --------------------------
+ * Give the current chunk to the next worker, once it has taken
+ * the last one.
+ */
+void
+stat_feed::send ()
+{
+    mailbox *b = v_box[next_box];
+    next_box = (next_box + 1) % unsigned (v_box.size());
+    {
+        unique_lock<mutex> lock (b->mtx);
+        b->cv.wait (lock, [b] { return ! b->full;});
+        b->data.swap (chunk);
+        b->full = true;
+    }
+    b->cv.notify_one();
+    chunk.clear();
+    if (chunk.capacity() < CHUNK)
+        chunk.reserve (CHUNK);
+}
+
+/* ---------------- stat_feed::finish ------------------------
+ */
+int
+stat_feed::finish ()
+{
+    if (chunk.size())
+        send();
+    for (mailbox *b : v_box) {
+        {
+            lock_guard<mutex> lock (b->mtx);
+            b->closed = true;
+        }
+        b->cv.notify_one();
+    }
+    for (thread &t : v_thr)
+        t.join();
+    for (dist_stat &s : v_stat)
+        if (dst->merge (s) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/*
+ * 19 Oct 2026
+ * Summaries of a distance matrix which can be built while it is
+ * read: a histogram with fixed bins and approximate quantiles
+ * from a t-digest.
+ * Can only be included after <ostream>, <string>, <thread> and <vector>
+ */
+#ifndef DIST_STAT_HH
+#define DIST_STAT_HH
+
+#ifdef __clang__
+#    pragma clang diagnostic push
+#    pragma clang diagnostic ignored "-Wpadded"
+#endif /* clang */
+
+/* ---------------- dist_stat --------------------------------
+ * Histogram of n_bin bins from lo to hi, plus counts of what
+ * fell outside. The t-digest keeps at most about delta clusters
+ * (centroids), which are small near the ends, so quantiles near
+ * 0 and 1 are good. New values wait in a buffer and are merged
+ * in when it fills. Two dist_stats with the same bins can be
+ * merged, so each thread can have its own.
+ */
+class dist_stat {
+private:
+    struct centroid {
+        double mean;
+        double w;
+    };
+    std::vector<size_t> v_bin;
+    std::vector<centroid> v_cen;     /* the digest, sorted by mean */
+    std::vector<centroid> v_buf;     /* waiting to be merged */
+    double lo, hi, bin_scale;
+    double delta;
+    double sum;
+    size_t n, n_below, n_above, n_nan;
+    float d_min, d_max;
+    void compress ();
+public:
+    dist_stat (const unsigned n_bin = 100, const double lo = 0.0, const double hi = 1.0,
+               const double delta = 200.0);
+    dist_stat blank () const { return dist_stat (unsigned (v_bin.size()), lo, hi, delta);}
+    void add (const float d);
+    int merge (dist_stat &other);
+    size_t get_n () const { return n;}
+    size_t get_n_nan () const { return n_nan;}
+    float get_min () const { return d_min;}
+    float get_max () const { return d_max;}
+    double get_mean () const { return n ? sum / double (n) : 0.0;}
+    double quantile (const double q);
+    size_t n_centroid () { compress(); return v_cen.size();}
+    void write_quantiles (std::ostream &out, const std::vector<double> &v_q);
+    void write_hist (std::ostream &out) const;
+};
+
+/* ---------------- stat_feed --------------------------------
+ * Somebody reading distances calls add() for each one. They are
+ * collected in chunks and each chunk goes to one of n_thread
+ * workers, each with its own dist_stat. finish() waits for the
+ * workers and merges everything into dst.
+ */
+class stat_feed {
+public:
+    struct mailbox;
+private:
+    std::vector<mailbox *> v_box;
+    std::vector<dist_stat> v_stat;
+    std::vector<std::thread> v_thr;
+    std::vector<float> chunk;
+    dist_stat *dst;
+    unsigned next_box;
+    void send ();
+    stat_feed (const stat_feed &);
+    stat_feed &operator= (const stat_feed &);
+public:
+    stat_feed (dist_stat &dst, unsigned n_thread);
+    ~stat_feed ();
+    void add (const float d) {
+        chunk.push_back (d);
+        if (chunk.size() == chunk.capacity())
+            send();
+    }
+    int finish ();
+};
+
+#ifdef __clang__
+#    pragma clang diagnostic pop
+#endif /* clang */
+
+#endif /* DIST_STAT_HH */
@@ -1,6 +1,10 @@
 /*
  * 22 oct 2015
  * Read a distance matrix that was written by mafft.
+ * 19 Oct 2026 We also read PHYLIP (square and lower triangle) and
+ * our own binary format. The format is found by looking at the
+ * start of the file. All the readers hand distances to a dm_sink,
+ * so they do not care how the dist_mat stores them.
  * The nice thing is that we do not have to worry about the tricky
  * indexing into a half array. We only want to store distances and the
  * relevant indices. It is this list we are going to sort.
@@ -21,20 +25,29 @@
  */
 
 #include <algorithm>
+#include <cctype>
 #include <cerrno>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <exception> // Probably also only during debugging
 #include <limits>
+#include <memory>
+#include <ostream>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "bust.hh"
 #include "distmat_rd.hh"
+#include "dist_stat.hh"
+#include "dm_runs.hh"
 #include "mgetline.hh"
 #include "prog_bug.hh"
 
@@ -42,88 +55,113 @@ using namespace std;
 
 /* ---------------- structures and constants ----------------- */
 static const char *NDX_STR = ". =";
+static const char DM_SAVE_MAGIC[8] = {'D', 'M', 'S', 'O', 'R', 'T', '1', '\n'};
+static const unsigned KEY_NDX_BITS = 24;            /* per index, in a dm_key */
+static const dm_key KEY_NDX_MASK = (dm_key (1) << KEY_NDX_BITS) - 1;
+static const unsigned Q_MAX = 0xffff;               /* biggest 16 bit distance */
+static const size_t TOK_BUF_SIZ = 1 << 20;          /* bytes read at once */
+static const size_t BIN_BUF_N = 1 << 18;            /* floats read at once */
+static const unsigned long MAX_NSEQ = 10000000;     /* same as read_info() */
+static const uint32_t MAX_NAME_LEN = 1 << 20;
+static const unsigned NO_ROW = numeric_limits<unsigned>::max();
+
+enum dm_fmt {
+    FMT_HAT2,
+    FMT_PHYLIP_SQ,
+    FMT_PHYLIP_LOW,
+    FMT_BIN
+};
+
+/* ---------------- tok_rd -----------------------------------
+ * Hand out lines or white space separated tokens from a stream,
+ * reading big blocks at a time, which is much quicker than
+ * mgetline() or infile >> f. Lines and tokens are nul terminated
+ * in place, so they can go straight to strtof() and friends.
+ */
+class tok_rd {
+private:
+    istream &in;
+    vector<char> buf;
+    size_t pos, end;
+    bool refill ();
+public:
+    tok_rd (istream &i) : in (i), buf (TOK_BUF_SIZ + 1), pos (0), end (0) {}
+    bool next (const char *&tok, size_t &len);
+    bool next_line (const char *&line, size_t &len);
+    bool next_float (float &f);
+    bool skip (size_t n);
+};
 
 /* ---------------- read_info  -------------------------------
- * We have bundles of sequences in a vector. Pull each from
- * the queue
+ * mafft starts with a line with 1, then the number of sequences,
+ * then a float we do not use. Only build error messages if
+ * something is wrong.
  */
 static unsigned
-read_info (ifstream &infile, const char *dist_fname){
-    stringstream errmsg (string (__func__) + ": reading distance matrix from " +
-                         string (dist_fname) + string (", "));
-    unsigned long i, nseq; /* excessive, but correct for stoul */
-    string t;
-    mgetline (infile, t);
-    try {
-        if ((i = stoul(t)) != 1) {
-            cerr << errmsg.str() << "expected 1 on first line, got:\n" + to_string(i) + string ("\n");
-            return 0;
-        }
-    } catch (const std::invalid_argument &e) {
-        cerr << e.what() << '\n';
-        cerr << errmsg.str() << "looking for a single integer, got\n" + t + "\n" +
+read_info (tok_rd &t_rd, const char *dist_fname){
+    const string errmsg = string (__func__) + ": reading distance matrix from " +
+                          string (dist_fname) + string (", ");
+    const char *t;
+    char *t_end;
+    size_t len;
+    if (! t_rd.next_line (t, len)) {
+        cerr << errmsg << "empty file\n";
+        return 0;
+    }
+    const unsigned long i = strtoul (t, &t_end, 10);
+    if (t_end == t) {
+        cerr << errmsg << "looking for a single integer, got\n" + string (t) + "\n" +
             __func__ + ": Check if " + dist_fname + " is really a distance matrix file\n";
         return 0;
     }
-
-    mgetline (infile, t);
-    nseq = stoul(t);
-    if (nseq > 10000000) {
-        cerr << errmsg.str() << ". Broken. nseq seems to be "<<nseq<<'\n';
+    if (i != 1) {
+        cerr << errmsg << "expected 1 on first line, got:\n" + to_string(i) + string ("\n");
         return 0;
     }
-
-    mgetline (infile, t); /* there is a float we do not use */
-    if (nseq > numeric_limits<unsigned>::max())
-        prog_bug (__FILE__, __LINE__, "too many sequences");
-    return unsigned (nseq);
-}
-
-struct int_comment {
-    string cmmt;
-    unsigned long i;
-};
-
-/* ---------------- split_cmmt  ------------------------------
- * given a sequence line from the mafft distance matrix file,
- * get out the index and the comment.
- */
-static struct int_comment
-split_cmmt (const string s) {
-    stringstream errmsg; errmsg << __func__;
-    string::size_type n;
-    struct int_comment i_c;
-    static const string::size_type i_off = string (NDX_STR).size();
-    n = s.find (NDX_STR);
-    if (n == string::npos) {
-        errmsg << ": broke looking for index in "<< s;
-        throw runtime_error (errmsg.str());
+    if (! t_rd.next_line (t, len)) {
+        cerr << errmsg << "no number of sequences\n";
+        return 0;
+    }
+    const unsigned long nseq = strtoul (t, &t_end, 10);
+    if (t_end == t || nseq > MAX_NSEQ) {
+        cerr << errmsg << ". Broken. nseq seems to be "<< string (t) <<'\n';
+        return 0;
     }
-    i_c.i = stoul (s.substr(0, n));
-    i_c.cmmt = s.substr (n + i_off);
-    return i_c;
+    t_rd.next_line (t, len); /* there is a float we do not use */
+    return unsigned (nseq);
 }
 
-
 /* ---------------- read_mafft_seq ---------------------------
+ * Each line looks like "  12. =name". Work on the line where
+ * it sits in the buffer and build each name once, with its ">".
  */
 static int
-read_mafft_seq (ifstream &infile, vector<string> &v_cmt,
+read_mafft_seq (tok_rd &t_rd, vector<string> &v_cmt,
                 const char *dist_fname, const unsigned nseq)
 {
     static const char *err_line = "Error reading line from ";
-    string t;
-    unsigned n = 0;
+    static const size_t i_off = strlen (NDX_STR);
     v_cmt.reserve (nseq);
     for (unsigned i = 1; i <= nseq; i++) {  /* starting from 1 */
-        if (!mgetline (infile, t))          /* allows the check below */
+        const char *t;
+        size_t len;
+        if (! t_rd.next_line (t, len))
             return (bust(__func__, err_line, dist_fname, 0));
-        struct int_comment i_c = split_cmmt (t);
-        if (i_c.i != ++n)
-            return (bust(__func__, "Did not get expected integer ", to_string(n).c_str(), 0));
-        v_cmt.push_back (string (">") + i_c.cmmt);
+        const char *ndx = strstr (t, NDX_STR);
+        if (ndx == nullptr)
+            return (bust (__func__, "broke looking for index in", t, 0));
+        char *n_end;
+        const unsigned long n = strtoul (t, &n_end, 10);
+        if (n != i || n_end != ndx)
+            return (bust(__func__, "Did not get expected integer ", to_string(i).c_str(), 0));
+        const char *name = ndx + i_off;
+        const size_t n_len = len - size_t (name - t);
+        v_cmt.emplace_back();
+        string &c = v_cmt.back();
+        c.reserve (n_len + 1);
+        c += '>';
+        c.append (name, n_len);
     }
-    v_cmt.shrink_to_fit();
     return EXIT_SUCCESS;
 }
 
@@ -168,42 +206,732 @@ get_next_float (ifstream &infile)
 }
 #endif /* use_get_next_float */
 
+/* ---------------- float_to_half ----------------------------
+ * Bits of an IEEE half precision number, rounding to nearest,
+ * ties to even. Too big becomes infinity.
+ */
+static unsigned short
+float_to_half (const float f)
+{
+    uint32_t x;
+    memcpy (&x, &f, sizeof (x));
+    const unsigned sign = (x >> 16) & 0x8000;
+    const int exp = int ((x >> 23) & 0xff);
+    uint32_t mant = x & 0x7fffff;
+    if (exp == 0xff)                              /* inf or NaN */
+        return (unsigned short) (sign | 0x7c00 | (mant ? 0x200 : 0));
+    const int e = exp - 127 + 15;
+    if (e >= 31)
+        return (unsigned short) (sign | 0x7c00);
+    if (e <= 0) {                                 /* subnormal or zero */
+        if (e < -10)
+            return (unsigned short) sign;
+        mant |= 0x800000;
+        const unsigned shift = unsigned (14 - e);
+        uint32_t h = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return (unsigned short) (sign | h);
+    }
+    uint32_t h = (uint32_t (e) << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;                                      /* may carry into exponent */
+    return (unsigned short) (sign | h);
+}
+
+/* ---------------- half_to_float ---------------------------- */
+static float
+half_to_float (const unsigned short h)
+{
+    const unsigned e = (h >> 10) & 0x1f;
+    const unsigned m = h & 0x3ff;
+    float f;
+    if (e == 0)
+        f = ldexpf (float (m), -24);
+    else if (e == 31)
+        f = m ? numeric_limits<float>::quiet_NaN() : numeric_limits<float>::infinity();
+    else
+        f = ldexpf (float (m | 0x400), int (e) - 25);
+    return (h & 0x8000) ? -f : f;
+}
+
+/* ---------------- quantise ---------------------------------
+ * Turn a distance into 16 bits which sort the same way as the
+ * distances. For halves, that means flipping negative numbers.
+ * For fixed point, the distance is q_lo + q / q_scale.
+ * NaN goes to the end.
+ */
+static unsigned short
+quantise (const float d, const dm_pack pack, const float q_lo, const double q_scale)
+{
+    if (pack == PACK_HALF) {
+        const unsigned short h = float_to_half (d);
+        if (h & 0x8000)
+            return (unsigned short) (~h);
+        return (unsigned short) (h | 0x8000);
+    }
+    if (!(d == d))
+        return Q_MAX;
+    const double x = (double (d) - q_lo) * q_scale + 0.5;
+    if (!(x > 0.0))
+        return 0;
+    if (x >= Q_MAX)
+        return Q_MAX;
+    return (unsigned short) x;
+}
+
+/* ---------------- unquantise ------------------------------- */
+static float
+unquantise (const unsigned short q, const dm_pack pack, const float q_lo, const double q_scale)
+{
+    if (pack == PACK_HALF) {
+        if (q & 0x8000)
+            return half_to_float ((unsigned short) (q & 0x7fff));
+        return half_to_float ((unsigned short) (~q));
+    }
+    if (q_scale == 0.0)
+        return q_lo;
+    return float (q_lo + q / q_scale);
+}
+
+/* ---------------- tok_rd::refill ---------------------------
+ * Move what we have not used to the start of the buffer and
+ * fill up behind it. Return false if nothing more came.
+ */
+bool
+tok_rd::refill ()
+{
+    const size_t keep = end - pos;
+    memmove (buf.data(), buf.data() + pos, keep);
+    pos = 0;
+    end = keep;
+    in.read (buf.data() + end, streamsize (TOK_BUF_SIZ - end));
+    const size_t got = size_t (in.gcount());
+    end += got;
+    return got > 0;
+}
+
+/* ---------------- tok_rd::next ----------------------------- */
+bool
+tok_rd::next (const char *&tok, size_t &len)
+{
+    for (;;) {                                    /* skip white space */
+        while (pos < end && isspace ((unsigned char) buf[pos]))
+            pos++;
+        if (pos < end)
+            break;
+        if (! refill())
+            return false;
+    }
+    size_t e = pos;
+    for (;;) {
+        while (e < end && ! isspace ((unsigned char) buf[e]))
+            e++;
+        if (e < end)
+            break;
+        const size_t off = e - pos;               /* token runs off the end */
+        if (end - pos >= TOK_BUF_SIZ || ! refill())
+            break;
+        e = pos + off;
+    }
+    buf[e] = '\0';                      /* over white space or past end */
+    tok = buf.data() + pos;
+    len = e - pos;
+    pos = (e < end) ? e + 1 : end;
+    return true;
+}
+
+/* ---------------- tok_rd::next_line ------------------------
+ * Like mgetline(), we jump over blank lines.
+ */
+bool
+tok_rd::next_line (const char *&line, size_t &len)
+{
+    for (;;) {
+        const char *nl = (const char *) memchr (buf.data() + pos, '\n', end - pos);
+        size_t e;
+        if (nl) {
+            e = size_t (nl - buf.data());
+        } else if (end - pos < TOK_BUF_SIZ && refill()) {
+            continue;
+        } else if (pos < end) {                  /* last line, no newline */
+            e = end;
+        } else {
+            return false;
+        }
+        buf[e] = '\0';
+        line = buf.data() + pos;
+        len = e - pos;
+        pos = (e < end) ? e + 1 : end;
+        if (len)
+            return true;
+    }
+}
+
+/* ---------------- tok_rd::skip -----------------------------
+ * Jump over n tokens without looking at them. This is for rows
+ * we do not want.
+ */
+bool
+tok_rd::skip (size_t n)
+{
+    bool in_tok = false;
+    while (n) {
+        if (pos == end && ! refill())
+            return (in_tok && n == 1);
+        if (isspace ((unsigned char) buf[pos++])) {
+            if (in_tok) {
+                in_tok = false;
+                n--;
+            }
+        } else {
+            in_tok = true;
+        }
+    }
+    return true;
+}
+
+/* ---------------- tok_rd::next_float ----------------------- */
+bool
+tok_rd::next_float (float &f)
+{
+    const char *tok;
+    size_t len;
+    if (! next (tok, len))
+        return false;
+    char *t_end;
+    f = strtof (tok, &t_end);
+    return t_end == tok + len;
+}
+
+/* ---------------- dm_sink ----------------------------------
+ * Whatever the file format, readers hand each distance to a
+ * sink. It either
+ *   - stores a dist_entry, spilling to runs on disk if there
+ *     are runs and the budget is full,
+ *   - stores the pair and distance in separate arrays, unless
+ *     it has to spill, when it works like the previous case,
+ *   - stores a packed key, noting the error, or
+ *   - only notes the range, for fixed point packing.
+ *   - only feeds the statistics.
+ * If opt.stat is set, a stat_feed gets every distance in wanted
+ * rows, on its own threads, whatever else happens to it.
+ * Pairs can come in any order, but i must be less than j.
+ * The sink can also be told to only keep some rows (by name) and
+ * distances up to max_dist. Then kept rows are renumbered from
+ * zero in the order they came, names of other rows are thrown
+ * away and readers can ask want_row() so as to skip rows without
+ * parsing them.
+ */
+class dm_sink {
+public:
+    enum mode { RANGE, ENTRY, PAIR, KEY, STAT };
+private:
+    mode m;
+    vector<dist_entry> *v_dist;
+    vector<dm_pair> *v_pair;
+    vector<float> *v_dval;
+    dm_runs *runs;
+    vector<dm_key> *v_key;
+    size_t run_len;                  /* zero means no spilling */
+    dm_pack pack;
+    float q_lo;
+    double q_scale;
+    float max_dist;                  /* negative means keep everything */
+    bool filter_rows;
+    unordered_set<string> want;      /* names of rows to keep */
+    vector<unsigned> v_remap;        /* old row number to new, or NO_ROW */
+    vector<unsigned> v_file_row;     /* new row number to old, once finished */
+    size_t n_file;                   /* rows in the file */
+    unique_ptr<stat_feed> feed;
+    vector<unsigned short> *v_tri16; /* copy of every distance, if wanted */
+    vector<double> *v_rsum;          /* sum of each row of v_tri16 */
+    size_t n_tri;
+public:
+    float lo, hi, q_err;
+    dm_sink (vector<dist_entry> &v, dm_runs *r)
+        : m (ENTRY), v_dist (&v), v_pair (nullptr), v_dval (nullptr), runs (r),
+          v_key (nullptr), run_len (0),
+          pack (PACK_NONE), q_lo (0), q_scale (0), max_dist (-1), filter_rows (false), n_file (0),
+          v_tri16 (nullptr), v_rsum (nullptr), n_tri (0), lo (0), hi (0), q_err (0) {}
+    dm_sink (vector<dm_pair> &p, vector<float> &dv, vector<dist_entry> &v, dm_runs *r)
+        : m (PAIR), v_dist (&v), v_pair (&p), v_dval (&dv), runs (r),
+          v_key (nullptr), run_len (0),
+          pack (PACK_NONE), q_lo (0), q_scale (0), max_dist (-1), filter_rows (false), n_file (0),
+          v_tri16 (nullptr), v_rsum (nullptr), n_tri (0), lo (0), hi (0), q_err (0) {}
+    dm_sink (vector<dm_key> &v, const dm_pack p, const float l, const double s)
+        : m (KEY), v_dist (nullptr), v_pair (nullptr), v_dval (nullptr), runs (nullptr),
+          v_key (&v), run_len (0),
+          pack (p), q_lo (l), q_scale (s), max_dist (-1), filter_rows (false), n_file (0),
+          v_tri16 (nullptr), v_rsum (nullptr), n_tri (0), lo (0), hi (0), q_err (0) {}
+    explicit dm_sink (const mode mm = RANGE)
+        : m (mm), v_dist (nullptr), v_pair (nullptr), v_dval (nullptr), runs (nullptr),
+          v_key (nullptr), run_len (0),
+          pack (PACK_NONE), q_lo (0), q_scale (0), max_dist (-1), filter_rows (false), n_file (0),
+          v_tri16 (nullptr), v_rsum (nullptr), n_tri (0),
+          lo (numeric_limits<float>::max()), hi (-numeric_limits<float>::max()), q_err (0) {}
+    void set_filter (const dm_opt &opt);
+    void set_tri (vector<unsigned short> &t, vector<double> &sum) { v_tri16 = &t; v_rsum = &sum;}
+    size_t get_n_tri () const { return n_tri;}
+    bool want_row (const unsigned i) const { return !filter_rows || v_remap[i] != NO_ROW;}
+    void set_names (vector<string> &v_cmt);
+    void get_file_rows (vector<unsigned> &file_row, size_t &n_row);
+    bool add_name (vector<string> &v_cmt, const string &name, const unsigned i);
+    int start (const unsigned nseq, const char *dist_fname);
+    int put (const float d, const unsigned i, const unsigned j);
+    int finish ();
+};
+
+/* ---------------- trim_white -------------------------------
+ * Names are compared without a leading ">" or white space at
+ * either end, like rmv_white_start_end() in filt_string.cc.
+ */
+static string
+trim_white (const string &s)
+{
+    static const char *white = " \t\r\n";
+    const size_t b = s.find_first_not_of (white, (s.size() && s[0] == '>') ? 1 : 0);
+    if (b == string::npos)
+        return string();
+    return s.substr (b, s.find_last_not_of (white) - b + 1);
+}
+
+/* ---------------- dm_sink::set_filter ---------------------- */
+void
+dm_sink::set_filter (const dm_opt &opt)
+{
+    max_dist = opt.max_dist;
+    if (opt.stat && m != RANGE)
+        feed.reset (new stat_feed (*opt.stat, 0));
+    if (opt.rows) {
+        filter_rows = true;
+        for (const string &s : *opt.rows)
+            want.insert (trim_white (s));
+    }
+}
+
+/* ---------------- dm_sink::set_names -----------------------
+ * We have all the names, as from mafft or binary files. Work out
+ * the new row numbers and only keep the names we want.
+ */
+void
+dm_sink::set_names (vector<string> &v_cmt)
+{
+    if (! filter_rows)
+        return;
+    unsigned k = 0;
+    for (unsigned i = 0; i < v_cmt.size(); i++) {
+        if (want.count (trim_white (v_cmt[i]))) {
+            v_remap[i] = k;
+            v_cmt[k++].swap (v_cmt[i]);
+        }
+    }
+    v_cmt.resize (k);
+    v_cmt.shrink_to_fit();
+}
+
+/* ---------------- dm_sink::get_file_rows ------------------
+ * If we only kept some rows, hand over where each one was in
+ * the file. Otherwise, file_row comes back empty.
+ */
+void
+dm_sink::get_file_rows (vector<unsigned> &file_row, size_t &n_row)
+{
+    file_row.swap (v_file_row);
+    v_file_row.clear();
+    n_row = n_file;
+}
+
+/* ---------------- dm_sink::add_name ------------------------
+ * PHYLIP names come one row at a time. Keep this one, if we
+ * want it, and say so.
+ */
+bool
+dm_sink::add_name (vector<string> &v_cmt, const string &name, const unsigned i)
+{
+    if (filter_rows) {
+        if (! want.count (trim_white (name)))
+            return false;
+        v_remap[i] = unsigned (v_cmt.size());
+    }
+    v_cmt.push_back (name);
+    return true;
+}
+
+/* ---------------- dm_sink::start ---------------------------
+ * We know how many sequences are coming, so get space. If we
+ * are filtering, we do not know how much we will need.
+ */
+int
+dm_sink::start (const unsigned nseq, const char *dist_fname)
+{
+    size_t ntmp = size_t (nseq) * (nseq - 1) / 2;
+    if (m == KEY && nseq > KEY_NDX_MASK + 1 && ! filter_rows)
+        return (bust (__func__, "too many sequences to pack distances from", dist_fname, 0));
+    if (filter_rows)
+        v_remap.assign (nseq, NO_ROW);
+    if (filter_rows || max_dist >= 0)
+        ntmp = 0;
+    if (v_tri16) {
+        n_tri = nseq;
+        try {
+            v_tri16->assign (size_t (nseq) * (nseq - 1) / 2, 0);
+            v_rsum->assign (nseq, 0.0);
+        } catch (bad_alloc &e) {
+            return (bust(__func__, "no space for a copy of the triangle from", dist_fname, 0));
+        }
+    }
+    if (runs && size_t (nseq) * (nseq - 1) / 2 > runs->get_max_ent())
+        ntmp = run_len = runs->get_max_ent();
+    try {
+        if (m == ENTRY || (m == PAIR && run_len))
+            v_dist->reserve (ntmp);
+        else if (m == PAIR) {
+            v_pair->reserve (ntmp);
+            v_dval->reserve (ntmp);
+        } else if (m == KEY)
+            v_key->reserve (ntmp);
+    } catch (bad_alloc &e) {
+        auto stmp = std::to_string(nseq);
+        return (bust(__func__, "Broke reserving space for", stmp.c_str(), "seqs", e.what(), 0));
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- dm_sink::put ----------------------------- */
+int
+dm_sink::put (const float d, const unsigned i_in, const unsigned j_in)
+{
+    unsigned i = i_in, j = j_in;
+    if (filter_rows) {
+        i = v_remap[i_in];
+        j = v_remap[j_in];
+        if (i == NO_ROW || j == NO_ROW)
+            return EXIT_SUCCESS;
+    }
+    if (feed)
+        feed->add (d);
+    if (v_tri16) {              /* sums match what get_row() will say */
+        const unsigned short h = float_to_half (d);
+        const float dh = half_to_float (h);
+        (*v_tri16) [tri_ndx (i, j, n_tri)] = h;
+        (*v_rsum)[i] += dh;
+        (*v_rsum)[j] += dh;
+    }
+    if (max_dist >= 0 && !(d <= max_dist))
+        return EXIT_SUCCESS;
+    if (filter_rows && m == KEY && j > KEY_NDX_MASK)
+        return (bust (__func__, "too many sequences to pack distances", 0));
+    switch (m) {
+    case STAT:
+        break;
+    case RANGE:
+        if (d < lo) lo = d;
+        if (d > hi) hi = d;
+        break;
+    case PAIR:
+        if (! run_len) {
+            v_pair->push_back ((dm_pair (i) << 32) | j);
+            v_dval->push_back (d);
+            break;
+        }
+        /* fall through */
+    case ENTRY:
+        v_dist->push_back ({d, i, j});
+        if (v_dist->size() == run_len)
+            return (runs->spill (*v_dist));
+        break;
+    case KEY: {
+        const unsigned short q = quantise (d, pack, q_lo, q_scale);
+        const float err = fabsf (unquantise (q, pack, q_lo, q_scale) - d);
+        if (err > q_err)
+            q_err = err;
+        v_key->push_back ((dm_key (q) << (2 * KEY_NDX_BITS)) |
+                          (dm_key (i) << KEY_NDX_BITS) | dm_key (j));
+        break;
+    }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- dm_sink::finish --------------------------
+ * If we have been spilling, the last, partial run goes out too.
+ */
+int
+dm_sink::finish ()
+{
+    if (m == ENTRY || m == PAIR) {
+        if (runs && runs->n_run() && v_dist->size())
+            if (runs->spill (*v_dist) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        v_dist->shrink_to_fit();
+        if (m == PAIR) {
+            v_pair->shrink_to_fit();
+            v_dval->shrink_to_fit();
+        }
+    } else if (m == KEY) {
+        v_key->shrink_to_fit();
+    }
+    if (filter_rows) {
+        for (unsigned i = 0; i < v_remap.size(); i++) {
+            if (v_remap[i] == NO_ROW)
+                continue;
+            if (v_remap[i] >= v_file_row.size())
+                v_file_row.resize (v_remap[i] + 1);
+            v_file_row [v_remap[i]] = i;
+        }
+        n_file = v_remap.size();
+        v_remap.clear();
+        v_remap.shrink_to_fit();
+    }
+    if (feed) {
+        const int r = feed->finish();
+        feed.reset();
+        return r;
+    }
+    return EXIT_SUCCESS;
+}
+
 /* ---------------- read_mafft_dist --------------------------
  * This seems to take a lot of time. I used to have
             size_t z = 0; char s[20]; infile >> s; f = stof (s, &z)
  * and it ran just as fast as directly saying infile >> f
+ * Now we read big blocks and cut them up ourselves (tok_rd).
  */
 static int
-read_mafft_dist (ifstream &infile, vector<struct dist_entry> &v_dist,
-                const char *dist_fname, const unsigned nseq)
+read_mafft_dist (tok_rd &t_rd, const char *dist_fname, const unsigned nseq, dm_sink &sink)
 {
     const char *read_err = "Reading error, parsing floats in ";
-    size_t ntmp = nseq * (nseq - 1) / 2;
-    try {
-        v_dist.reserve (ntmp);
-    } catch (bad_alloc &e) {
-        auto stmp = std::to_string(nseq);
-        return (bust(__func__, "Broke reserving space for", stmp.c_str(), "seqs", e.what(), 0));
+    for (unsigned i = 0; i < nseq ; i++) {
+        if (! sink.want_row (i)) {
+            if (! t_rd.skip (nseq - i - 1))
+                return (bust(__func__, read_err, dist_fname, 0));
+            continue;
+        }
+        for (unsigned j = i+1; j < nseq; j++) {
+            float d;
+            if (! sink.want_row (j)) {
+                if (! t_rd.skip (1))
+                    return (bust(__func__, read_err, dist_fname, 0));
+                continue;
+            }
+            if (! t_rd.next_float (d))
+                return (bust(__func__, read_err, dist_fname, 0));
+            if (sink.put (d, i, j) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
     }
-    try {
-        for (unsigned i = 0; i < nseq ; i++) {
-            for (unsigned j = i+1; j < nseq; j++) {
-                struct dist_entry d_e = { -99, i, j};
-#                   ifdef use_get_next_float
-                        d_e.dist = get_next_float(infile);
-#                   else            
-                        infile >> d_e.dist;
-#                   endif   /* use_get_next_float */
-            v_dist.push_back(d_e);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- read_hat2 --------------------------------
+ * Read a whole mafft file. The distances go to the sink in the
+ * order they were found.
+ */
+static int
+read_hat2 (const char *dist_fname, vector<string> &v_cmt, dm_sink &sink)
+{
+    const char *e_info = "Failed reading info lines from";
+    ifstream infile (dist_fname);
+    if (!infile)
+        return (bust (__func__, "Failed opening ", dist_fname, ": ", strerror(errno), 0));
+
+    tok_rd t_rd (infile);
+    unsigned nseq;
+    if ((nseq = read_info (t_rd, dist_fname)) == 0)
+        return (bust (__func__, e_info, dist_fname, 0));
+
+    if (read_mafft_seq (t_rd, v_cmt, dist_fname, nseq) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (sink.start (nseq, dist_fname) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    sink.set_names (v_cmt);
+    if (read_mafft_dist (t_rd, dist_fname, nseq, sink) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    infile.close();
+    return sink.finish();
+}
+
+/* ---------------- read_phylip ------------------------------
+ * PHYLIP distance matrices start with the number of sequences.
+ * Each row has a name, then either every distance (square) or
+ * the distances to the sequences before it (lower triangle).
+ * Rows may be wrapped over several lines. Names may not contain
+ * white space (relaxed PHYLIP). For square matrices we take the
+ * lower triangle, so we know which rows we want before we see
+ * their distances, and skip the rest of each row. We do not check
+ * it matches the upper triangle.
+ */
+static int
+read_phylip (const char *dist_fname, const bool lower, vector<string> &v_cmt, dm_sink &sink)
+{
+    ifstream infile (dist_fname);
+    if (!infile)
+        return (bust (__func__, "Failed opening ", dist_fname, ": ", strerror(errno), 0));
+    tok_rd t_rd (infile);
+    const char *tok;
+    size_t len;
+    if (! t_rd.next (tok, len))
+        return (bust (__func__, "empty file", dist_fname, 0));
+    char *t_end;
+    const unsigned long nseq = strtoul (tok, &t_end, 10);
+    if (t_end != tok + len || nseq < 2 || nseq > MAX_NSEQ)
+        return (bust (__func__, "bad number of sequences at start of", dist_fname, 0));
+    if (sink.start (unsigned (nseq), dist_fname) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    const char *read_err = "Reading error, parsing floats in row";
+    for (unsigned i = 0; i < nseq; i++) {
+        if (! t_rd.next (tok, len))
+            return (bust (__func__, "missing row", to_string (i + 1).c_str(), "in", dist_fname, 0));
+        const size_t n_rest = lower ? 0 : nseq - i;     /* diagonal and upper */
+        if (! sink.add_name (v_cmt, string (">") + string (tok, len), i)) {
+            if (! t_rd.skip (i + n_rest))
+                return (bust (__func__, read_err, to_string (i + 1).c_str(), "of", dist_fname, 0));
+            continue;
+        }
+        for (unsigned j = 0; j < i; j++) {
+            float d;
+            if (! sink.want_row (j)) {
+                if (! t_rd.skip (1))
+                    return (bust (__func__, read_err, to_string (i + 1).c_str(), "of", dist_fname, 0));
+                continue;
             }
+            if (! t_rd.next_float (d))
+                return (bust (__func__, read_err, to_string (i + 1).c_str(), "of", dist_fname, 0));
+            if (sink.put (d, j, i) == EXIT_FAILURE)
+                return EXIT_FAILURE;
         }
-    } catch (ios_base::failure &e) {
-        return (bust(__func__, read_err, dist_fname, "\n", e.what(), 0));
+        if (! t_rd.skip (n_rest))
+            return (bust (__func__, read_err, to_string (i + 1).c_str(), "of", dist_fname, 0));
     }
-    v_dist.shrink_to_fit();
+    infile.close();
+    return sink.finish();
+}
+
+/* ---------------- read_bin ---------------------------------
+ * Our own binary format, as written by write_bin().
+ *   DM_BIN_MAGIC, 8 bytes
+ *   number of sequences, 32 bit unsigned
+ *   for each name, its length (32 bits) then the characters
+ *   upper triangle, row by row, as 32 bit floats
+ * Everything is in the machine's byte order.
+ */
+static int
+read_bin (const char *dist_fname, vector<string> &v_cmt, dm_sink &sink)
+{
+    const char *read_err = "Reading error, truncated binary matrix ";
+    ifstream infile (dist_fname, ios::binary);
+    if (!infile)
+        return (bust (__func__, "Failed opening ", dist_fname, ": ", strerror(errno), 0));
+    char magic [sizeof (DM_BIN_MAGIC)];
+    uint32_t nseq;
+    infile.read (magic, sizeof (magic));
+    infile.read ((char *) &nseq, sizeof (nseq));
+    if (!infile || memcmp (magic, DM_BIN_MAGIC, sizeof (magic)) != 0)
+        return (bust (__func__, read_err, dist_fname, 0));
+    if (nseq < 2 || nseq > MAX_NSEQ)
+        return (bust (__func__, "bad number of sequences in", dist_fname, 0));
+    v_cmt.reserve (nseq);
+    for (unsigned i = 0; i < nseq; i++) {
+        uint32_t len;
+        if (! infile.read ((char *) &len, sizeof (len)) || len > MAX_NAME_LEN)
+            return (bust (__func__, read_err, dist_fname, 0));
+        string s (len, ' ');
+        if (len && ! infile.read (&s[0], len))
+            return (bust (__func__, read_err, dist_fname, 0));
+        v_cmt.push_back (string (">") + s);
+    }
+    if (sink.start (nseq, dist_fname) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    sink.set_names (v_cmt);
+    vector<float> buf (BIN_BUF_N);
+    size_t b_pos = 0, b_end = 0;
+    for (unsigned i = 0; i < nseq; i++) {
+        if (! sink.want_row (i)) {               /* jump over the row */
+            const size_t n_skip = nseq - i - 1;
+            if (n_skip <= b_end - b_pos) {
+                b_pos += n_skip;
+            } else {
+                infile.seekg (streamoff ((n_skip - (b_end - b_pos)) * sizeof (float)), ios::cur);
+                b_pos = b_end = 0;
+            }
+            continue;
+        }
+        for (unsigned j = i + 1; j < nseq; j++) {
+            if (b_pos == b_end) {
+                infile.read ((char *) buf.data(), streamsize (buf.size() * sizeof (float)));
+                b_end = size_t (infile.gcount()) / sizeof (float);
+                b_pos = 0;
+                if (b_end == 0)
+                    return (bust (__func__, read_err, dist_fname, 0));
+            }
+            if (sink.put (buf[b_pos++], i, j) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
+    }
+    infile.close();
+    return sink.finish();
+}
+
+/* ---------------- detect_fmt -------------------------------
+ * Look at the start of a file to see what kind of matrix it is.
+ *   binary   - starts with DM_BIN_MAGIC
+ *   mafft    - "1", then the number of sequences, on its own line
+ *   PHYLIP   - the number of sequences, then a row. If the first
+ *              row has only a name, it is a lower triangle.
+ */
+static int
+detect_fmt (const char *dist_fname, dm_fmt &fmt)
+{
+    ifstream infile (dist_fname, ios::binary);
+    if (!infile)
+        return (bust (__func__, "Failed opening ", dist_fname, ": ", strerror(errno), 0));
+    char magic [sizeof (DM_BIN_MAGIC)];
+    if (infile.read (magic, sizeof (magic)) &&
+        memcmp (magic, DM_BIN_MAGIC, sizeof (magic)) == 0) {
+        fmt = FMT_BIN;
+        return EXIT_SUCCESS;
+    }
+    infile.clear();
+    infile.seekg (0);
+    string l1, l2;
+    mgetline (infile, l1);
+    mgetline (infile, l2);
+    istringstream s1 (l1), s2 (l2);
+    unsigned long n1, n2;
+    string rest;
+    if (! (s1 >> n1))
+        return (bust (__func__, dist_fname, "does not start with a number. Not a distance matrix", 0));
+    if (n1 == 1 && (s2 >> n2) && !(s2 >> rest)) {
+        fmt = FMT_HAT2;
+        return EXIT_SUCCESS;
+    }
+    unsigned n_tok = 0;
+    for (istringstream s3 (l2); s3 >> rest; )
+        n_tok++;
+    fmt = (n_tok == 1) ? FMT_PHYLIP_LOW : FMT_PHYLIP_SQ;
     return EXIT_SUCCESS;
 }
 
+/* ---------------- read_dm_file -----------------------------
+ * Work out the format and read any kind of matrix into a sink.
+ */
+static int
+read_dm_file (const char *dist_fname, vector<string> &v_cmt, dm_sink &sink)
+{
+    dm_fmt fmt;
+    if (detect_fmt (dist_fname, fmt) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    switch (fmt) {
+    case FMT_HAT2:       return (read_hat2 (dist_fname, v_cmt, sink));
+    case FMT_PHYLIP_SQ:  return (read_phylip (dist_fname, false, v_cmt, sink));
+    case FMT_PHYLIP_LOW: return (read_phylip (dist_fname, true, v_cmt, sink));
+    case FMT_BIN:        return (read_bin (dist_fname, v_cmt, sink));
+    }
+    return EXIT_FAILURE;
+}
 
 /* ---------------- no_node_in_common ------------------------
  */
@@ -256,7 +984,7 @@ get_relevant_pair (const struct dist_entry &a, const struct dist_entry &b)
  * If the distances are equal, we have to compare based on
  * node names.
  */
-static bool
+bool
 dist_ent_cmp (const struct dist_entry &a, const struct dist_entry &b)
 {
     if (a.dist < b.dist)
@@ -275,68 +1003,860 @@ dist_ent_cmp (const struct dist_entry &a, const struct dist_entry &b)
 }
 
 
+/* ---------------- str_to_pack ------------------------------
+ * Turn "half" or "fixed" from the command line into a dm_pack.
+ */
+int
+str_to_pack (const char *s, dm_pack &pack)
+{
+    if (strcmp (s, "half") == 0)
+        pack = PACK_HALF;
+    else if (strcmp (s, "fixed") == 0)
+        pack = PACK_FIXED;
+    else
+        return (bust (__func__, "packing should be \"half\" or \"fixed\", not", s, 0));
+    return EXIT_SUCCESS;
+}
+
 /* ---------------- read_distmat -----------------------------
+ * Read everything and sort it all, right now.
  */
 int
 read_distmat (const char *dist_fname, vector<dist_entry> &v_dist, vector<string> &v_cmt)
 {
-    const char *e_info = "Failed reading info lines from";
-    ifstream infile (dist_fname);
-    if (!infile)
-        return (bust (__func__, "Failed opening ", dist_fname, ": ", strerror(errno), 0));
-
-    unsigned nseq;
-    if ((nseq = read_info (infile, dist_fname)) == 0)
-        return (bust (__func__, e_info, dist_fname, 0));
-
-    if (read_mafft_seq (infile, v_cmt, dist_fname, nseq) == EXIT_FAILURE)
+    dm_sink sink (v_dist, nullptr);
+    if (read_dm_file (dist_fname, v_cmt, sink) == EXIT_FAILURE)
         return EXIT_FAILURE;
 
-    if (read_mafft_dist (infile, v_dist, dist_fname, nseq) == EXIT_FAILURE)
-        return EXIT_FAILURE;
-    infile.close();
-
     std::sort( v_dist.begin(), v_dist.end(), dist_ent_cmp);
 
     return EXIT_SUCCESS;
 }
 
+/* ---------------- read_dist_stat ---------------------------
+ * Only collect the statistics in opt.stat. We keep the names
+ * and nothing else.
+ */
+int
+read_dist_stat (const char *dist_fname, const dm_opt &opt, vector<string> &v_cmt)
+{
+    if (! opt.stat)
+        return (bust (__func__, "programming bug. Nowhere to put statistics", 0));
+    dm_sink sink (dm_sink::STAT);
+    sink.set_filter (opt);
+    return (read_dm_file (dist_fname, v_cmt, sink));
+}
+
 /* ---------------- dist_mat as class ------------------------
  * Above, I wrote C.
  * Now I will make a dist_mat class. This version has everything.
  * It will be a bit memory hungry, but I need the name to
  * index mapping as well as the distance matrix.
+ * Unlike read_distmat(), we do not sort here. We only drop the
+ * entries into their buckets.
+ * With a memory budget, we start off assuming we will need runs
+ * on disk. If nothing was spilled, we throw them away again.
+ * Packed entries are squeezed as they are read, so we never hold
+ * the full size ones. Fixed point needs the range first, so then
+ * we read the file twice.
+ */
+dist_mat::dist_mat (const char *dist_fname, const dm_opt &opt)
+{
+    n_sorted = 0;
+    bkt_done = 0;
+    n_ent = 0;
+    n_tri = 0;
+    runs = nullptr;
+    pack = PACK_NONE;
+    q_lo = 0.0;
+    q_scale = 0.0;
+    q_err = 0.0;
+    fail_bit = true;
+    n_file_row = 0;
+    sparse = (opt.rows != nullptr || opt.max_dist >= 0);
+    if (opt.rows && opt.row_dist) {   /* rows are not known until read */
+        cerr << __func__ << ": cannot keep whole rows (row_dist) when only some rows are read\n";
+        return;
+    }
+    if (opt.pack != PACK_NONE && opt.mem_budget)
+        cerr << __func__ << ": packed distances cannot go to disk. Not packing.\n";
+    else
+        pack = opt.pack;
+    const string e_read = string (__func__) + ": reading from " + dist_fname + '\n';
+    if (pack == PACK_FIXED) {
+        vector<string> v_tmp;
+        dm_sink range;
+        range.set_filter (opt);
+        if (read_dm_file (dist_fname, v_tmp, range) == EXIT_FAILURE) {
+            cerr << e_read;
+            return;
+        }
+        q_lo = range.lo;
+        if (range.hi > range.lo)
+            q_scale = Q_MAX / (double (range.hi) - double (range.lo));
+    }
+    if (pack != PACK_NONE) {
+        dm_sink sink (v_key, pack, q_lo, q_scale);
+        sink.set_filter (opt);
+        if (opt.row_dist)
+            sink.set_tri (v_tri16, v_rsum);
+        if (read_dm_file (dist_fname, v_cmt, sink) == EXIT_FAILURE) {
+            cerr << e_read;
+            return;
+        }
+        fail_bit = false;
+        n_tri = sink.get_n_tri();
+        sink.get_file_rows (v_file_row, n_file_row);
+        q_err = sink.q_err;
+        n_ent = v_key.size();
+        key_partition();
+        return;
+    }
+
+    if (opt.mem_budget)
+        runs = new dm_runs (opt.scratch_dir, opt.mem_budget / sizeof (dist_entry));
+    dm_sink sink (v_pair, v_dval, v_dist, runs);
+    sink.set_filter (opt);
+    if (opt.row_dist)
+        sink.set_tri (v_tri16, v_rsum);
+    if (read_dm_file (dist_fname, v_cmt, sink) == EXIT_FAILURE) {
+        cerr << e_read;
+        return;
+    }
+    fail_bit = false;
+    n_tri = sink.get_n_tri();
+    sink.get_file_rows (v_file_row, n_file_row);
+    if (runs && runs->n_run() == 0) {
+        delete runs;
+        runs = nullptr;
+        take_entries (v_dist);     /* only if we filtered down to fit */
+    }
+    if (runs) {
+        n_ent = runs->size();
+    } else {
+        n_ent = v_pair.size();
+        bkt_partition();
+    }
+}
+
+/* ---------------- dist_mat from a triangle ----------------
+ * Somebody has calculated the distances for us. tri is the upper
+ * triangle, row by row. We take over the names from cmt, which
+ * is left empty. If row_dist is set, keep a half precision copy
+ * of tri for get_row().
  */
-dist_mat::dist_mat (const char *dist_fname)
+dist_mat::dist_mat (vector<string> &cmt, const vector<float> &tri, const bool row_dist)
 {
-    if (read_distmat (dist_fname, v_dist, v_cmt) == EXIT_FAILURE) {
+    n_sorted = 0;
+    bkt_done = 0;
+    n_ent = 0;
+    n_tri = 0;
+    runs = nullptr;
+    pack = PACK_NONE;
+    q_lo = 0.0;
+    q_scale = 0.0;
+    q_err = 0.0;
+    n_file_row = 0;
+    sparse = false;
+    v_cmt.swap (cmt);
+    const unsigned nseq = unsigned (v_cmt.size());
+    if (tri.size() != size_t (nseq) * (nseq - 1) / 2) {
         fail_bit = true;
-        cerr << string (__func__) + ": reading from " + dist_fname + '\n';
+        cerr << string (__func__) + ": triangle does not match " + to_string (nseq) + " names\n";
+        return;
+    }
+    v_pair.reserve (tri.size());
+    for (unsigned i = 0; i < nseq; i++)
+        for (unsigned j = i + 1; j < nseq; j++)
+            v_pair.push_back ((dm_pair (i) << 32) | j);
+    v_dval = tri;
+    if (row_dist) {
+        n_tri = nseq;
+        v_tri16.resize (tri.size());
+        v_rsum.assign (nseq, 0.0);
+        size_t k = 0;
+        for (unsigned i = 0; i < nseq; i++) {
+            for (unsigned j = i + 1; j < nseq; j++, k++) {
+                v_tri16[k] = float_to_half (tri[k]);
+                const float dh = half_to_float (v_tri16[k]);
+                v_rsum[i] += dh;
+                v_rsum[j] += dh;
+            }
+        }
+    }
+    fail_bit = false;
+    n_ent = v_pair.size();
+    bkt_partition();
+}
+
+/* ---------------- dist_mat from edges --------------------
+ * Not every pair has a distance, only those in edge. This is
+ * what we get from nearest neighbours. We take over the names
+ * and the edges, leaving cmt and edge empty. ndx1 must be less
+ * than ndx2 in each edge.
+ */
+dist_mat::dist_mat (vector<string> &cmt, vector<dist_entry> &edge)
+{
+    n_sorted = 0;
+    bkt_done = 0;
+    n_ent = 0;
+    n_tri = 0;
+    runs = nullptr;
+    pack = PACK_NONE;
+    q_lo = 0.0;
+    q_scale = 0.0;
+    q_err = 0.0;
+    n_file_row = 0;
+    sparse = true;
+    v_cmt.swap (cmt);
+    const size_t nseq = v_cmt.size();
+    for (const dist_entry &e : edge) {
+        if (e.ndx1 >= e.ndx2 || e.ndx2 >= nseq) {
+            fail_bit = true;
+            cerr << string (__func__) + ": bad edge " + to_string (e.ndx1) + ' '
+                + to_string (e.ndx2) + " for " + to_string (nseq) + " names\n";
+            return;
+        }
+    }
+    fail_bit = false;
+    take_entries (edge);
+    n_ent = v_pair.size();
+    bkt_partition();
+}
+
+/* ---------------- take_entries -----------------------------
+ * Move entries into v_pair and v_dval and free v. Briefly, this
+ * needs twice the memory.
+ */
+void
+dist_mat::take_entries (vector<dist_entry> &v)
+{
+    v_pair.reserve (v_pair.size() + v.size());
+    v_dval.reserve (v_dval.size() + v.size());
+    for (const dist_entry &d_e : v) {
+        v_pair.push_back ((dm_pair (d_e.ndx1) << 32) | d_e.ndx2);
+        v_dval.push_back (d_e.dist);
+    }
+    vector<dist_entry>().swap (v);
+}
+
+/* ---------------- dist_mat::~dist_mat ----------------------
+ */
+dist_mat::~dist_mat ()
+{
+    delete runs;
+}
+
+/* ---------------- bkt_ndx ----------------------------------
+ * Which bucket does a distance go into ? This only has to be
+ * monotonic in the distance, so equal distances always land
+ * in the same bucket and no bucket holds anything smaller than
+ * its predecessor.
+ */
+static size_t
+bkt_ndx (const float dist, const double dmin, const double scale, const size_t nbkt)
+{
+    const double x = (double (dist) - dmin) * scale;
+    if (!(x > 0.0))                  /* also catches NaN */
+        return 0;
+    if (x >= double (nbkt - 1))
+        return nbkt - 1;
+    return size_t (x);
+}
+
+/* ---------------- bkt_partition ----------------------------
+ * Histogram the distances, then shuffle v_pair and v_dval in
+ * place so each bucket is contiguous (an american flag pass). This is
+ * linear, unlike the sort, which we put off until somebody
+ * asks for the entries in a bucket.
+ */
+void
+dist_mat::bkt_partition ()
+{
+    static const size_t BKT_AVG = 1024;   /* entries per bucket, on average */
+    static const size_t MAX_BKT = 1 << 20;
+    const size_t n_ent = v_pair.size();
+    size_t nbkt = n_ent / BKT_AVG + 1;
+    if (nbkt > MAX_BKT)
+        nbkt = MAX_BKT;
+    float dmin = numeric_limits<float>::max();
+    float dmax = -numeric_limits<float>::max();
+    for (const float d : v_dval) {
+        if (d < dmin) dmin = d;
+        if (d > dmax) dmax = d;
+    }
+    double scale = 0.0;
+    if (dmax > dmin)
+        scale = double (nbkt) / (double (dmax) - double (dmin));
+    else
+        nbkt = 1;
+
+    vector<size_t> bkt_next (nbkt + 1, 0);   /* first a histogram */
+    for (const float d : v_dval)
+        bkt_next [bkt_ndx (d, dmin, scale, nbkt) + 1]++;
+    for (size_t b = 1; b <= nbkt; b++)       /* then starts of buckets */
+        bkt_next[b] += bkt_next[b - 1];
+    v_bkt_end.assign (bkt_next.begin() + 1, bkt_next.end());
+
+    for (size_t b = 0; b < nbkt; b++) {
+        while (bkt_next[b] < v_bkt_end[b]) {
+            dm_pair p = v_pair [bkt_next[b]];
+            float d = v_dval [bkt_next[b]];
+            size_t to = bkt_ndx (d, dmin, scale, nbkt);
+            while (to != b) {            /* follow the cycle until we */
+                const size_t k = bkt_next[to]++;         /* get back home */
+                swap (p, v_pair [k]);
+                swap (d, v_dval [k]);
+                to = bkt_ndx (d, dmin, scale, nbkt);
+            }
+            v_pair [bkt_next[b]] = p;
+            v_dval [bkt_next[b]++] = d;
+        }
+    }
+    n_sorted = 0;
+    bkt_done = 0;
+}
+
+/* ---------------- key_partition ----------------------------
+ * Like bkt_partition(), but for packed keys. The 16 bit
+ * distances are the buckets.
+ */
+void
+dist_mat::key_partition ()
+{
+    const size_t nbkt = Q_MAX + 1;
+    const unsigned q_shift = 2 * KEY_NDX_BITS;
+    vector<size_t> bkt_next (nbkt + 1, 0);
+    for (const dm_key k : v_key)
+        bkt_next [(k >> q_shift) + 1]++;
+    for (size_t b = 1; b <= nbkt; b++)
+        bkt_next[b] += bkt_next[b - 1];
+    v_bkt_end.assign (bkt_next.begin() + 1, bkt_next.end());
+
+    for (size_t b = 0; b < nbkt; b++) {
+        while (bkt_next[b] < v_bkt_end[b]) {
+            dm_key k = v_key [bkt_next[b]];
+            size_t to = size_t (k >> q_shift);
+            while (to != b) {
+                swap (k, v_key [bkt_next[to]++]);
+                to = size_t (k >> q_shift);
+            }
+            v_key [bkt_next[b]++] = k;
+        }
+    }
+    n_sorted = 0;
+    bkt_done = 0;
+}
+
+/* ---------------- sort_pair_bkt ----------------------------
+ * Sort [b_start..b_end) of v_pair and v_dval. We copy the bucket
+ * out as dist_entry so the order is exactly that of dist_ent_cmp.
+ * Buckets are small, so the copy is cheap.
+ */
+void
+dist_mat::sort_pair_bkt (const size_t b_start, const size_t b_end)
+{
+    v_sort.resize (b_end - b_start);
+    for (size_t k = b_start; k < b_end; k++)
+        v_sort [k - b_start] = {v_dval[k], unsigned (v_pair[k] >> 32), unsigned (v_pair[k])};
+    std::sort (v_sort.begin(), v_sort.end(), dist_ent_cmp);
+    for (size_t k = b_start; k < b_end; k++) {
+        const dist_entry &d_e = v_sort [k - b_start];
+        v_pair[k] = (dm_pair (d_e.ndx1) << 32) | d_e.ndx2;
+        v_dval[k] = d_e.dist;
+    }
+}
+
+/* ---------------- sort_next_bkt ----------------------------
+ * Sort the next bucket that has something in it. Everything
+ * before it is already in its final place.
+ */
+void
+dist_mat::sort_next_bkt ()
+{
+    while (bkt_done < v_bkt_end.size()) {
+        const size_t b_end = v_bkt_end [bkt_done++];
+        if (b_end == n_sorted)                   /* empty bucket */
+            continue;
+        if (pack)
+            std::sort (v_key.begin() + long (n_sorted), v_key.begin() + long (b_end));
+        else
+            sort_pair_bkt (n_sorted, b_end);
+        n_sorted = b_end;
+        return;
+    }
+}
+
+/* ---------------- dist_mat::begin --------------------------
+ */
+dist_mat::edge_iter
+dist_mat::begin()
+{
+    if (runs) {
+        if (runs->start() == EXIT_FAILURE)
+            throw runtime_error (string (__func__) + ": starting merge of scratch files");
+        ext_next();
     } else {
-        fail_bit = false;
+        if (n_sorted == 0)
+            sort_next_bkt();
+        if (pack && n_ent)
+            key_next (0);
     }
+    return edge_iter (this, 0);
+}
+
+/* ---------------- key_entry --------------------------------
+ * Unpack a key.
+ */
+dist_entry
+dist_mat::key_entry (const dm_key k) const
+{
+    dist_entry d_e;
+    d_e.dist = unquantise ((unsigned short) (k >> (2 * KEY_NDX_BITS)), pack, q_lo, q_scale);
+    d_e.ndx1 = unsigned ((k >> KEY_NDX_BITS) & KEY_NDX_MASK);
+    d_e.ndx2 = unsigned (k & KEY_NDX_MASK);
+    return d_e;
+}
+
+/* ---------------- key_next ---------------------------------
+ * Unpack key i into ext_cur.
+ */
+void
+dist_mat::key_next (const size_t i)
+{
+    ext_cur = key_entry (v_key[i]);
+}
+
+/* ---------------- dist_mat::sort_all -----------------------
+ * Finish the lazy sort. After this, edge_at() may be called
+ * from any number of threads, since nothing changes any more.
+ * Runs on disk can only be merged by one walk, so they are no
+ * good here.
+ */
+int
+dist_mat::sort_all ()
+{
+    if (runs)
+        return (bust (__func__, "distances are in scratch files, so cannot be shared", 0));
+    while (bkt_done < v_bkt_end.size())
+        sort_next_bkt();
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- dist_mat::begin_at -----------------------
+ * Like begin(), but start at entry i. Only after sort_all().
+ */
+dist_mat::edge_iter
+dist_mat::begin_at (const size_t i)
+{
+    if (runs || bkt_done < v_bkt_end.size())
+        prog_bug (__FILE__, __LINE__, "begin_at() before sort_all()");
+    if (pack && i < n_ent)
+        key_next (i);
+    return edge_iter (this, i);
+}
+
+/* ---------------- dist_mat::first_from ---------------------
+ * Where is the first entry with a distance not below d ? Only
+ * after sort_all().
+ */
+size_t
+dist_mat::first_from (const float d) const
+{
+    size_t lo = 0, hi = n_ent;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (edge_at (mid).dist < d)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* ---------------- dist_mat::add_rows -----------------------
+ * New sequences, new_cmt, go on the end of the names, so the old
+ * ones keep their numbers. edge has their distances, to old or
+ * new sequences, numbered that way. The edges are sorted and
+ * merged into the sorted entries, which gives the same order as
+ * sorting everything, since ties go by index. We take over the
+ * names and edges, leaving them empty. Only for entries which
+ * are sorted in memory, not packed and without rows.
+ */
+int
+dist_mat::add_rows (vector<string> &new_cmt, vector<dist_entry> &edge)
+{
+    if (runs || pack || n_tri || bkt_done < v_bkt_end.size())
+        return (bust (__func__, "can only add to sorted, unpacked distances in memory", 0));
+    const size_t n_old = v_cmt.size(), nseq = n_old + new_cmt.size();
+    for (dist_entry &e : edge) {
+        if (e.ndx1 > e.ndx2)
+            swap (e.ndx1, e.ndx2);
+        if (e.ndx1 == e.ndx2 || e.ndx2 < n_old || e.ndx2 >= nseq)
+            return (bust (__func__, "bad new entry", to_string (e.ndx1).c_str(),
+                          to_string (e.ndx2).c_str(), 0));
+    }
+    std::sort (edge.begin(), edge.end(), dist_ent_cmp);
+    vector<dm_pair> m_pair;
+    vector<float> m_dval;
+    m_pair.reserve (n_ent + edge.size());
+    m_dval.reserve (n_ent + edge.size());
+    size_t i = 0;
+    for (const dist_entry &e : edge) {
+        for ( ; i < n_ent && dist_ent_cmp (edge_at (i), e); i++) {
+            m_pair.push_back (v_pair[i]);
+            m_dval.push_back (v_dval[i]);
+        }
+        m_pair.push_back ((dm_pair (e.ndx1) << 32) | e.ndx2);
+        m_dval.push_back (e.dist);
+    }
+    m_pair.insert (m_pair.end(), v_pair.begin() + long (i), v_pair.end());
+    m_dval.insert (m_dval.end(), v_dval.begin() + long (i), v_dval.end());
+    v_pair.swap (m_pair);
+    v_dval.swap (m_dval);
+    vector<dist_entry>().swap (edge);
+    v_cmt.insert (v_cmt.end(), new_cmt.begin(), new_cmt.end());
+    new_cmt.clear();
+    n_ent = v_pair.size();
+    n_sorted = n_ent;
+    if (n_ent != nseq * (nseq - 1) / 2)
+        sparse = true;
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- put_vec ----------------------------------
+ * A vector of plain numbers as a 64 bit count and the bytes.
+ */
+template <typename T>
+static void
+put_vec (ostream &out, const vector<T> &v)
+{
+    const uint64_t n = v.size();
+    out.write ((const char *) &n, sizeof (n));
+    out.write ((const char *) v.data(), streamsize (n * sizeof (T)));
+}
+
+/* ---------------- get_vec ----------------------------------
+ * Read what put_vec() wrote. Return false if there is not enough
+ * or the count is more than max_n.
+ */
+template <typename T>
+static bool
+get_vec (istream &in, vector<T> &v, const uint64_t max_n)
+{
+    uint64_t n = 0;
+    in.read ((char *) &n, sizeof (n));
+    if (!in || n > max_n)
+        return false;
+    v.resize (n);
+    in.read ((char *) v.data(), streamsize (n * sizeof (T)));
+    return bool (in);
+}
+
+/* ---------------- dist_mat::save ---------------------------
+ * Write names, sorted entries and rows, in the machine's byte
+ * order. Only for a matrix in memory which has been through
+ * sort_all().
+ */
+int
+dist_mat::save (ostream &out) const
+{
+    if (runs || bkt_done < v_bkt_end.size())
+        return (bust (__func__, "only sorted distances in memory can be saved", 0));
+    const uint64_t head[5] = {v_cmt.size(), n_ent, n_tri, uint64_t (pack), uint64_t (sparse)};
+    out.write (DM_SAVE_MAGIC, sizeof (DM_SAVE_MAGIC));
+    out.write ((const char *) head, sizeof (head));
+    out.write ((const char *) &q_lo, sizeof (q_lo));
+    out.write ((const char *) &q_scale, sizeof (q_scale));
+    out.write ((const char *) &q_err, sizeof (q_err));
+    for (const string &s : v_cmt) {
+        const uint32_t len = uint32_t (s.size());
+        out.write ((const char *) &len, sizeof (len));
+        out.write (s.data(), len);
+    }
+    put_vec (out, v_pair);
+    put_vec (out, v_dval);
+    put_vec (out, v_key);
+    put_vec (out, v_tri16);
+    if (!out)
+        return (bust (__func__, "error writing distances", 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- dist_mat from a saved one ---------------
+ * Read what save() wrote. Everything is sorted already, so there
+ * are no buckets. fname is only for complaining.
+ */
+dist_mat::dist_mat (istream &in, const char *fname)
+{
+    n_sorted = 0;
+    bkt_done = 0;
+    n_ent = 0;
+    n_tri = 0;
+    runs = nullptr;
+    pack = PACK_NONE;
+    q_lo = 0.0;
+    q_scale = 0.0;
+    q_err = 0.0;
+    n_file_row = 0;
+    sparse = false;
+    fail_bit = true;
+    const string e_read = string (__func__) + ": broken saved distances in " + fname + '\n';
+    char magic [sizeof (DM_SAVE_MAGIC)];
+    uint64_t head[5];
+    in.read (magic, sizeof (magic));
+    in.read ((char *) head, sizeof (head));
+    in.read ((char *) &q_lo, sizeof (q_lo));
+    in.read ((char *) &q_scale, sizeof (q_scale));
+    in.read ((char *) &q_err, sizeof (q_err));
+    if (!in || memcmp (magic, DM_SAVE_MAGIC, sizeof (magic)) != 0
+        || head[0] > MAX_NSEQ || head[2] > head[0] || head[3] > PACK_FIXED) {
+        cerr << e_read;
+        return;
+    }
+    n_ent = head[1];
+    n_tri = head[2];
+    pack = dm_pack (head[3]);
+    sparse = head[4] != 0;
+    v_cmt.resize (head[0]);
+    for (string &s : v_cmt) {
+        uint32_t len = 0;
+        in.read ((char *) &len, sizeof (len));
+        if (!in || len > MAX_NAME_LEN) {
+            cerr << e_read;
+            return;
+        }
+        s.resize (len);
+        in.read (&s[0], len);
+    }
+    const uint64_t n_pair = pack ? 0 : n_ent, n_key = pack ? n_ent : 0;
+    if (! get_vec (in, v_pair, n_pair) || ! get_vec (in, v_dval, n_pair)
+        || ! get_vec (in, v_key, n_key) || ! get_vec (in, v_tri16, n_tri * (n_tri - 1) / 2)
+        || v_pair.size() != n_pair || v_dval.size() != n_pair || v_key.size() != n_key
+        || v_tri16.size() != (n_tri ? n_tri * (n_tri - 1) / 2 : 0)) {
+        cerr << e_read;
+        return;
+    }
+    n_sorted = n_ent;
+    add_up_rows();
+    fail_bit = false;
+}
+
+/* ---------------- ext_next ---------------------------------
+ * Pull the next entry out of the merge of runs on disk.
+ */
+void
+dist_mat::ext_next ()
+{
+    if (! runs->next (ext_cur))
+        prog_bug (__FILE__, __LINE__, "ran out of entries in merge");
 }
 
 /* ---------------- get_dist    ------------------------------
  * Return the distance between the two named entries.
  * Numbering is from zero up.
  * This may be very slow, but we only do this for a few distances
- * right at the end of the procedure.
+ * right at the end of the procedure. The order of entries does
+ * not matter here, so we do not care what has been sorted.
+ * If entries were dropped, a missing pair is not a bug and we
+ * return NaN.
  */
 float
 dist_mat::get_pair_dist (const unsigned node1, const unsigned node2) const
 {
     if (node1 == node2) return 0.0;
-    vector<dist_entry>::const_iterator d_it  = v_dist.begin();
-    const vector<dist_entry>::const_iterator d_end = v_dist.end();
-    for ( ; d_it < d_end; d_it++) {
-        unsigned ndx1 = d_it->ndx1;
-        unsigned ndx2 = d_it->ndx2;
-        if ( ((node1 == ndx1) && (node2 == ndx2)) ||
-             ((node1 == ndx2) && (node2 == ndx1)))
-            return d_it->dist;
+    if (runs) {
+        float dist;
+        if (runs->find_pair (node1, node2, &dist))
+            return dist;
+    }
+    if (pack) {
+        const dm_key lo = min (node1, node2), hi = max (node1, node2);
+        const dm_key want = (lo << KEY_NDX_BITS) | hi;
+        for (const dm_key k : v_key)
+            if ((k & ((dm_key (1) << (2 * KEY_NDX_BITS)) - 1)) == want)
+                return unquantise ((unsigned short) (k >> (2 * KEY_NDX_BITS)), pack, q_lo, q_scale);
     }
+    const dm_pair lo = min (node1, node2), hi = max (node1, node2);
+    const dm_pair want = (lo << 32) | hi;
+    for (size_t k = 0; k < v_pair.size(); k++)
+        if (v_pair[k] == want)
+            return v_dval[k];
+    if (sparse)
+        return numeric_limits<float>::quiet_NaN();
     string s = "Distance not found in dist mat, node indices: ";
     s += to_string(node1) + ' ' + to_string (node2);
     prog_bug (__FILE__, __LINE__, s.c_str());
 }
+
+
+/* ---------------- half_table -------------------------------
+ * Every half, as a float, so rows can be unpacked quickly.
+ */
+static const vector<float> &
+half_table ()
+{
+    static const vector<float> tab = [] {
+        vector<float> t (1 << 16);
+        for (size_t h = 0; h < t.size(); h++)
+            t[h] = half_to_float ((unsigned short) h);
+        return t;
+    } ();
+    return tab;
+}
+
+/* ---------------- dist_mat::get_row ------------------------
+ * Distances from i to everybody, from the copy of the triangle.
+ * row[i] is zero. Only if has_rows().
+ */
+void
+dist_mat::get_row (const unsigned i, vector<float> &row) const
+{
+    const float *tab = half_table().data();
+    row.resize (n_tri);
+    for (size_t j = 0; j < i; j++)
+        row[j] = tab [v_tri16 [tri_ndx (j, i, n_tri)]];
+    row[i] = 0.0;
+    const unsigned short *p = v_tri16.data() + (i + 1 < n_tri ? tri_ndx (i, i + 1, n_tri) : 0);
+    for (size_t j = i + 1; j < n_tri; j++)
+        row[j] = tab [*p++];
+}
+
+/* ---------------- dist_mat::sum_to -------------------------
+ * Sum of the distances from row i to each row in v_j, looked up
+ * in the triangle, so it costs the same wherever they are.
+ */
+double
+dist_mat::sum_to (const unsigned i, const vector<unsigned> &v_j) const
+{
+    const float *tab = half_table().data();
+    const unsigned short *tri = v_tri16.data();
+    double sum = 0.0;
+    for (const unsigned j : v_j)
+        if (j != i)
+            sum += tab [tri [i < j ? tri_ndx (i, j, n_tri) : tri_ndx (j, i, n_tri)]];
+    return sum;
+}
+
+/* ---------------- row_sum_worker ---------------------------
+ * Add up rows t, t + n_thr, ... of the triangle into sum, which
+ * belongs to this thread.
+ */
+static void
+row_sum_worker (const unsigned short *tri, const size_t n, const unsigned t,
+                const unsigned n_thr, vector<double> *sum)
+{
+    const float *tab = half_table().data();
+    vector<double> &s = *sum;
+    s.assign (n, 0.0);
+    for (size_t i = t; i + 1 < n; i += n_thr) {
+        const unsigned short *p = tri + tri_ndx (i, i + 1, n);
+        double row = 0.0;
+        for (size_t j = i + 1; j < n; j++, p++) {
+            const float d = tab[*p];
+            row += d;
+            s[j] += d;
+        }
+        s[i] += row;
+    }
+}
+
+/* ---------------- dist_mat::add_up_rows --------------------
+ * Usually the row sums are collected as the matrix is read. A
+ * saved matrix only has the triangle, so add up its rows here.
+ * Rows are dealt out to threads like cards, so each gets long
+ * and short ones.
+ */
+void
+dist_mat::add_up_rows ()
+{
+    vector<double> &sum = v_rsum;
+    sum.assign (n_tri, 0.0);
+    if (n_tri < 2)
+        return;
+    unsigned n_thr = thread::hardware_concurrency();
+    if (n_thr == 0)
+        n_thr = 1;
+    if (n_thr > n_tri / 2 + 1)
+        n_thr = unsigned (n_tri / 2 + 1);
+    vector<vector<double>> v_sum (n_thr);
+    vector<thread> v_thr;
+    for (unsigned t = 0; t < n_thr; t++)
+        v_thr.push_back (thread (row_sum_worker, v_tri16.data(), n_tri, t, n_thr, &v_sum[t]));
+    for (thread &t : v_thr)
+        t.join();
+    for (const vector<double> &s : v_sum)
+        for (size_t i = 0; i < n_tri; i++)
+            sum[i] += s[i];
+}
+
+/* ---------------- sub_tri ----------------------------------
+ * Pull out the matrix for the rows where keep is set, as names
+ * and an upper triangle, ready for write_hat2() or write_bin().
+ * Rows keep their order. We make one pass over the entries as
+ * they are stored, so nothing has to be sorted, whatever was
+ * walked before. A sparse matrix has pairs with no entry, which
+ * a full triangle cannot show, so it is refused.
+ */
+struct sub_arg {
+    const vector<unsigned> *remap;
+    vector<float> *tri;
+    size_t n;
+};
+
+static bool
+sub_put (const dist_entry &d_e, void *arg)
+{
+    sub_arg *a = static_cast<sub_arg *>(arg);
+    unsigned i = (*a->remap)[d_e.ndx1], j = (*a->remap)[d_e.ndx2];
+    if (i == NO_ROW || j == NO_ROW)
+        return false;
+    if (i > j)
+        swap (i, j);
+    (*a->tri)[tri_ndx (i, j, a->n)] = d_e.dist;
+    return false;
+}
+
+int
+dist_mat::sub_tri (const vector<bool> &keep, vector<string> &cmt, vector<float> &tri) const
+{
+    if (keep.size() != v_cmt.size())
+        return (bust (__func__, "programming bug. keep does not match names", 0));
+    if (sparse)
+        return (bust (__func__, "some pairs have no distance, so there is no whole matrix to write", 0));
+    vector<unsigned> remap (v_cmt.size(), NO_ROW);
+    cmt.clear();
+    for (size_t i = 0; i < v_cmt.size(); i++) {
+        if (keep[i]) {
+            remap[i] = unsigned (cmt.size());
+            cmt.push_back (v_cmt[i]);
+        }
+    }
+    const size_t n = cmt.size();
+    tri.assign (n * (n - 1) / 2, 0.0);
+    sub_arg a = {&remap, &tri, n};
+    if (runs) {
+        try {
+            runs->scan (sub_put, &a);
+        } catch (runtime_error &e) {
+            return (bust (__func__, e.what(), 0));
+        }
+    } else if (pack) {
+        dist_entry d_e;
+        for (const dm_key k : v_key) {
+            d_e.dist = unquantise ((unsigned short) (k >> (2 * KEY_NDX_BITS)), pack, q_lo, q_scale);
+            d_e.ndx1 = unsigned ((k >> KEY_NDX_BITS) & KEY_NDX_MASK);
+            d_e.ndx2 = unsigned (k & KEY_NDX_MASK);
+            sub_put (d_e, &a);
+        }
+    } else {
+        dist_entry d_e;
+        for (size_t k = 0; k < v_pair.size(); k++) {
+            d_e.dist = v_dval[k];
+            d_e.ndx1 = unsigned (v_pair[k] >> 32);
+            d_e.ndx2 = unsigned (v_pair[k]);
+            sub_put (d_e, &a);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,6 @@
 /*
  * 22 oct 2015
- * Can only be included after <string> and <vector>
+ * Can only be included after <iosfwd>, <string> and <vector>
  */
 #ifndef DISTMAT_RD_HH
 #define DISTMAT_RD_HH
@@ -11,24 +11,221 @@ struct dist_entry {
 };
 
 int read_distmat (const char *, std::vector<dist_entry> &, std::vector<std::string> &);
+bool dist_ent_cmp (const dist_entry &a, const dist_entry &b);
+
+/* ---------------- tri_ndx ----------------------------------
+ * Where is the pair i < j in the upper triangle of an n x n
+ * matrix, stored row by row, as mafft writes it ?
+ */
+inline size_t
+tri_ndx (const size_t i, const size_t j, const size_t n)
+{
+    return i * (2 * n - i - 1) / 2 + (j - i - 1);
+}
+
+/* ---------------- dm_opt -----------------------------------
+ * How should a dist_mat be loaded ?
+ * mem_budget is the number of bytes we may use for distance
+ * entries. Zero means keep everything in memory. Otherwise,
+ * matrices that do not fit are sorted in runs in scratch_dir.
+ * pack says if distances should be squeezed into 16 bits, as an
+ * IEEE half or fixed point over the range in the file.
+ * If rows is set, only rows with these names are kept and they
+ * are numbered from zero in the order of the file. If max_dist
+ * is not negative, only distances up to it are kept. Other
+ * entries are dropped while reading.
+ * If stat is set, it gets a histogram and quantiles of all the
+ * distances between wanted rows, before max_dist is applied.
+ * If row_dist is set, every distance is also kept in a triangle
+ * of 16 bit halves, before max_dist is applied, so a whole row
+ * can be read at once. This cannot go with rows.
+ */
+enum dm_pack {
+    PACK_NONE,
+    PACK_HALF,
+    PACK_FIXED
+};
+
+class dist_stat;
+struct dm_opt {
+    size_t mem_budget;
+    const char *scratch_dir;
+    dm_pack pack;
+    float max_dist;
+    const std::vector<std::string> *rows;
+    dist_stat *stat;
+    bool row_dist;
+    dm_opt () : mem_budget (0), scratch_dir ("/tmp"), pack (PACK_NONE),
+                max_dist (-1.0), rows (nullptr), stat (nullptr), row_dist (false) {}
+};
+
+/* ---------------- dm_key -----------------------------------
+ * A packed distance entry. The 16 bit distance is on top, then
+ * 24 bits for each index, so sorting keys as integers sorts by
+ * distance, then index, and limits us to 16 million sequences.
+ */
+typedef unsigned long long dm_key;
+
+/* ---------------- dm_pair ----------------------------------
+ * Both indices of an entry in one word, ndx1 on top. The
+ * distance lives in a separate array.
+ */
+typedef unsigned long long dm_pair;
+
+/* ---------------- DM_BIN_MAGIC -----------------------------
+ * Start of a binary distance matrix file.
+ */
+static const char DM_BIN_MAGIC[8] = {'D', 'M', 'A', 'T', 'F', '3', '2', '\n'};
+
+int str_to_pack (const char *s, dm_pack &pack);
+int read_dist_stat (const char *dist_fname, const dm_opt &opt, std::vector<std::string> &v_cmt);
 
 #ifdef __clang__
 #    pragma clang diagnostic push
 #    pragma clang diagnostic ignored "-Wpadded"
 #endif /* clang */
 
+/* ---------------- dist_mat ---------------------------------
+ * The distances are not sorted when we read them. They are
+ * dropped into buckets by distance and a bucket is only sorted
+ * when somebody walks into it with an edge_iter. Walking from
+ * begin() to end() gives exactly the order of a full sort.
+ * If the entries did not fit in the memory budget, they live in
+ * sorted runs on disk (runs is set) and an edge_iter pulls them
+ * out of a merge, one at a time. Then only one walk at a time
+ * is possible.
+ * If pack is set, entries are stored as keys in v_key. An
+ * edge_iter unpacks each key into ext_cur, so again only one walk
+ * at a time.
+ * For several walks at once, in threads, call sort_all() and
+ * then read entries with edge_at().
+ * After sort_all(), save() writes everything to a stream, so a
+ * later run can be built from it without reading or sorting.
+ * add_rows() puts new sequences on the end and merges their
+ * entries into the sorted ones. begin_at() starts a walk part
+ * way down and first_from() says where a distance starts.
+ * v_tri16 is only there if asked for. It is the upper triangle
+ * of n_tri rows in half precision, in file order, for get_row()
+ * and sum_to(). It is n(n-1)/2 entries of 2 bytes on top of the
+ * entries themselves. v_rsum has the sum of each row, collected
+ * while reading, for row_sums().
+ * Otherwise, the pairs are in v_pair and the distances in v_dval,
+ * so a walk that mostly looks at indices (ndx1(), ndx2()) does not
+ * drag the distances through the cache. v_dist is only used while
+ * reading, for runs that go to disk.
+ */
+class dm_runs;
 class dist_mat {
 private:
+    std::vector<dm_pair> v_pair;
+    std::vector<float> v_dval;     /* distance for each v_pair */
+    std::vector<dm_key> v_key;     /* instead of v_pair, if packed */
     std::vector<dist_entry> v_dist;
+    std::vector<dist_entry> v_sort; /* scratch for sorting a bucket */
+    std::vector<unsigned short> v_tri16;
+    std::vector<double> v_rsum;    /* sum of each row of v_tri16 */
+    size_t n_tri;
     std::vector<std::string> v_cmt;
+    std::vector<size_t> v_bkt_end; /* end of each bucket */
+    size_t n_sorted;               /* [0..n_sorted) is in final order */
+    size_t bkt_done;               /* number of buckets sorted so far */
+    size_t n_ent;
+    dm_runs *runs;                 /* only if we spilled to disk */
+    dist_entry ext_cur;            /* current entry from runs or keys */
+    dm_pack pack;
+    float q_lo;                    /* fixed point is q_lo + q / q_scale */
+    double q_scale;
+    float q_err;                   /* biggest error from packing */
+    bool sparse;                   /* not every pair has an entry */
+    std::vector<unsigned> v_file_row; /* row in the file, if rows were filtered */
+    size_t n_file_row;             /* rows in the file, if rows were filtered */
     bool fail_bit;
+    void bkt_partition ();
+    void key_partition ();
+    void sort_next_bkt ();
+    void sort_pair_bkt (const size_t b_start, const size_t b_end);
+    void ext_next ();
+    void add_up_rows ();
+    void key_next (const size_t i);
+    dist_entry key_entry (const dm_key k) const;
+    void take_entries (std::vector<dist_entry> &v);
+    dist_mat (const dist_mat &);
+    dist_mat &operator= (const dist_mat &);
 public:
-    dist_mat (const char *);
-    std::vector<std::string> get_cmt_vec() const {return v_cmt;}
-    std::vector<dist_entry> get_dist() const {return v_dist;}
+    class edge_iter {
+    private:
+        dist_mat *d_m;
+        size_t i;
+        mutable dist_entry cur;
+        bool ext () const { return d_m->runs || d_m->pack;}
+    public:
+        edge_iter (dist_mat *d, const size_t n) : d_m (d), i (n), cur () {}
+        unsigned ndx1 () const {
+            return ext() ? d_m->ext_cur.ndx1 : unsigned (d_m->v_pair[i] >> 32);}
+        unsigned ndx2 () const {
+            return ext() ? d_m->ext_cur.ndx2 : unsigned (d_m->v_pair[i]);}
+        float dist () const {
+            return ext() ? d_m->ext_cur.dist : d_m->v_dval[i];}
+        const dist_entry &operator* () const {
+            if (ext())
+                return d_m->ext_cur;
+            cur.dist = d_m->v_dval[i];
+            cur.ndx1 = ndx1();
+            cur.ndx2 = ndx2();
+            return cur;
+        }
+        const dist_entry *operator->() const { return &(**this);}
+        edge_iter &operator++ () {
+            ++i;
+            if (d_m->runs) {
+                if (i < d_m->n_ent)
+                    d_m->ext_next();
+            } else {
+                if (i == d_m->n_sorted)
+                    d_m->sort_next_bkt();
+                if (d_m->pack && i < d_m->n_ent)
+                    d_m->key_next (i);
+            }
+            return *this;
+        }
+        bool operator== (const edge_iter &e) const { return i == e.i;}
+        bool operator!= (const edge_iter &e) const { return i != e.i;}
+    };
+    dist_mat (const char *, const dm_opt &opt = dm_opt());
+    dist_mat (std::vector<std::string> &cmt, const std::vector<float> &tri,
+              const bool row_dist = false);
+    dist_mat (std::vector<std::string> &cmt, std::vector<dist_entry> &edge);
+    dist_mat (std::istream &in, const char *fname);
+    ~dist_mat ();
+    edge_iter begin();
+    edge_iter end() { return edge_iter (this, n_ent);}
+    edge_iter begin_at (const size_t i);
+    int sort_all ();
+    int save (std::ostream &out) const;
+    int add_rows (std::vector<std::string> &new_cmt, std::vector<dist_entry> &edge);
+    size_t first_from (const float d) const;
+    size_t n_edge () const { return n_ent;}
+    dist_entry edge_at (const size_t i) const {  /* only after sort_all() */
+        if (pack)
+            return key_entry (v_key[i]);
+        return {v_dval[i], unsigned (v_pair[i] >> 32), unsigned (v_pair[i])};
+    }
+    bool on_disk () const { return runs != nullptr;}
+    dm_pack get_pack () const { return pack;}
+    float get_q_err () const { return q_err;}
+    const std::vector<std::string> &get_cmt_vec() const {return v_cmt;}
     std::vector<std::string>::size_type get_n_mem() const {return v_cmt.size();}
-    std::string get_cmt(const unsigned i) const { return v_cmt[i];}
+    const std::string &get_cmt(const unsigned i) const { return v_cmt[i];}
+    unsigned file_row (const unsigned i) const { return v_file_row.empty() ? i : v_file_row[i];}
+    size_t get_n_file_row () const { return v_file_row.empty() ? v_cmt.size() : n_file_row;}
     float get_pair_dist (const unsigned, const unsigned) const ;
+    bool has_rows () const { return n_tri != 0;}
+    bool is_sparse () const { return sparse;}
+    void get_row (const unsigned i, std::vector<float> &row) const;
+    const std::vector<double> &row_sums () const { return v_rsum;}
+    double sum_to (const unsigned i, const std::vector<unsigned> &v_j) const;
+    int sub_tri (const std::vector<bool> &keep, std::vector<std::string> &cmt,
+                 std::vector<float> &tri) const;
     bool operator!() const { return !fail_bit ;}
     bool fail() {return fail_bit;}
 };
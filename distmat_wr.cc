@@ -0,0 +1,147 @@
+/*
+ * 19 Oct 2026
+ * Write a distance matrix the way mafft does, so that anything
+ * which reads .hat2 files (including us) can read it. Or write our
+ * binary format, which is smaller and much quicker to read.
+ *   - a line with 1, then the number of sequences, then a float
+ *   - one line per name, like "   4. =name"
+ *   - the upper triangle, row by row. Twelve numbers per line and
+ *     each row starts on a new line.
+ * There can be a lot of numbers, so we do not use printf() for
+ * them. They all have three decimal places.
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "distmat_wr.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const unsigned PER_LINE = 12;
+static const size_t   WBUF_SIZ = 1 << 20;
+
+/* ---------------- fmt_dist ---------------------------------
+ * Like sprintf (p, "%6.3f", f), but quicker. If a number fills
+ * the whole width, put a space in front anyway, so numbers cannot
+ * run into each other. Return the new end of the buffer.
+ */
+static char *
+fmt_dist (char *p, const float f)
+{
+    double x = f;
+    if (!(fabs (x) < 1e9))                    /* silly or NaN */
+        return p + sprintf (p, " %.3f", x);
+    const bool neg = x < 0;
+    if (neg)
+        x = -x;
+    const double y = x * 1000.0;      /* exact, since f was only a float */
+    unsigned long v = (unsigned long) y;
+    const double r = y - double (v);
+    if (r > 0.5 || (r == 0.5 && (v & 1)))  /* round half to even, like printf */
+        v++;
+    char digits [16];
+    unsigned nd = 0;
+    unsigned long ip = v / 1000;
+    do {
+        digits[nd++] = char ('0' + ip % 10);
+        ip /= 10;
+    } while (ip);
+    const unsigned len = nd + 4 + (neg ? 1 : 0);
+    for (unsigned w = (len < 6) ? len : 5; w < 6; w++)      /* pad to width */
+        *p++ = ' ';
+    if (neg)
+        *p++ = '-';
+    while (nd)
+        *p++ = digits[--nd];
+    const unsigned frac = unsigned (v % 1000);
+    *p++ = '.';
+    *p++ = char ('0' + frac / 100);
+    *p++ = char ('0' + (frac / 10) % 10);
+    *p++ = char ('0' + frac % 10);
+    return p;
+}
+
+/* ---------------- write_hat2 -------------------------------
+ * v_tri has the upper triangle of distances, row by row. Names
+ * in v_cmt start with ">", which mafft does not write.
+ */
+int
+write_hat2 (const char *fname, const vector<string> &v_cmt, const vector<float> &v_tri)
+{
+    const size_t nseq = v_cmt.size();
+    if (v_tri.size() != nseq * (nseq - 1) / 2)
+        return (bust (__func__, "programming bug. Triangle is the wrong size for", fname, 0));
+    ofstream outfile (fname);
+    if (!outfile)
+        return (bust (__func__, "Open fail for writing on", fname, ": ", strerror(errno), 0));
+
+    outfile << "    1\n" << nseq << "\n0.000\n";
+    for (size_t i = 0; i < nseq; i++) {
+        const string &s = v_cmt[i];
+        const size_t skip = (s.size() && s[0] == '>') ? 1 : 0;
+        char num [32];
+        snprintf (num, sizeof (num), "%4lu. =", (unsigned long) (i + 1));
+        outfile << num << s.substr (skip) << '\n';
+    }
+
+    vector<char> buf (WBUF_SIZ + 64 * PER_LINE);
+    char *p = buf.data();
+    vector<float>::const_iterator d_it = v_tri.begin();
+    for (size_t i = 0; i < nseq; i++) {
+        for (size_t j = i + 1, n = 1; j < nseq; j++, n++) {
+            p = fmt_dist (p, *d_it++);
+            if (n % PER_LINE == 0 || j == nseq - 1) {
+                *p++ = '\n';
+                if (p - buf.data() >= long (WBUF_SIZ)) {
+                    outfile.write (buf.data(), p - buf.data());
+                    p = buf.data();
+                }
+            }
+        }
+    }
+    outfile.write (buf.data(), p - buf.data());
+    outfile.close();
+    if (outfile.fail())
+        return (bust (__func__, "Error writing to", fname, 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- write_bin --------------------------------
+ * The binary format that read_bin() in distmat_rd.cc reads. Names
+ * lose their leading ">", as for write_hat2().
+ */
+int
+write_bin (const char *fname, const vector<string> &v_cmt, const vector<float> &v_tri)
+{
+    const size_t nseq = v_cmt.size();
+    if (v_tri.size() != nseq * (nseq - 1) / 2)
+        return (bust (__func__, "programming bug. Triangle is the wrong size for", fname, 0));
+    ofstream outfile (fname, ios::binary);
+    if (!outfile)
+        return (bust (__func__, "Open fail for writing on", fname, ": ", strerror(errno), 0));
+    const uint32_t n32 = uint32_t (nseq);
+    outfile.write (DM_BIN_MAGIC, sizeof (DM_BIN_MAGIC));
+    outfile.write ((const char *) &n32, sizeof (n32));
+    for (const string &s : v_cmt) {
+        const size_t skip = (s.size() && s[0] == '>') ? 1 : 0;
+        const uint32_t len = uint32_t (s.size() - skip);
+        outfile.write ((const char *) &len, sizeof (len));
+        outfile.write (s.data() + skip, len);
+    }
+    outfile.write ((const char *) v_tri.data(), streamsize (v_tri.size() * sizeof (float)));
+    outfile.close();
+    if (outfile.fail())
+        return (bust (__func__, "Error writing to", fname, 0));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,14 @@
+/*
+ * 19 Oct 2026
+ * Writing distance matrices.
+ * Can only be included after <string> and <vector>
+ */
+#ifndef DISTMAT_WR_HH
+#define DISTMAT_WR_HH
+
+int write_hat2 (const char *fname, const std::vector<std::string> &v_cmt,
+                const std::vector<float> &v_tri);
+int write_bin (const char *fname, const std::vector<std::string> &v_cmt,
+               const std::vector<float> &v_tri);
+
+#endif /* DISTMAT_WR_HH */
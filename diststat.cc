@@ -0,0 +1,146 @@
+/*
+ * 19 Oct 2026
+ * Read a distance matrix and print how the distances are spread,
+ * without keeping or sorting them. This is for choosing how many
+ * sequences reduce should keep or what cutoff findpath can use.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>   /* non standard, but for getopt() */
+#include <vector>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "dist_stat.hh"
+#include "mgetline.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const double DFLT_Q[] = {0.0001, 0.001, 0.01, 0.05, 0.1, 0.25,
+                                0.5, 0.75, 0.9, 0.95, 0.99};
+
+/* ---------------- usage ------------------------------------ */
+static int usage ( const char *progname, const char *s)
+{
+    static const char *u
+        = " [-H] [-b n_bin] [-l lo] [-q q1,q2,...] [-r rows_fname] [-u hi] dist_mat\n";
+    return (bust(progname, s, "\n", progname, u, 0));
+}
+
+/* ---------------- get_q_list -------------------------------
+ * Turn "0.1,0.5,0.9" into numbers.
+ */
+static int
+get_q_list (const char *s, vector<double> &v_q)
+{
+    stringstream ss (s);
+    string tok;
+    v_q.clear();
+    while (getline (ss, tok, ',')) {
+        size_t n = 0;
+        double q;
+        try {
+            q = stod (tok, &n);
+        } catch (const std::exception &e) {
+            return (bust (__func__, "bad quantile", tok.c_str(), 0));
+        }
+        if (n != tok.size() || q < 0.0 || q > 1.0)
+            return (bust (__func__, "quantiles go from 0 to 1, not", tok.c_str(), 0));
+        v_q.push_back (q);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- get_rows ---------------------------------
+ */
+static int
+get_rows (const char *fname, vector<string> &v_rows)
+{
+    ifstream infile (fname);
+    if (!infile)
+        return (bust (__func__, "opening", fname, ":", strerror (errno), 0));
+    string s;
+    while (mgetline (infile, s))
+        v_rows.push_back (s);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- main  ------------------------------------ */
+int
+main (int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    const char *rows_fname = nullptr;
+    unsigned n_bin = 100;
+    double lo = 0.0, hi = 1.0;
+    bool hist = true;
+    vector<double> v_q (DFLT_Q, DFLT_Q + sizeof (DFLT_Q) / sizeof (DFLT_Q[0]));
+    int c;
+    while ((c = getopt (argc, argv, "b:Hl:q:r:u:")) != -1) {
+        try {
+            switch (c) {
+            case 'b':
+                n_bin = unsigned (stoul (optarg));                     break;
+            case 'H':
+                hist = false;                                          break;
+            case 'l':
+                lo = stod (optarg);                                    break;
+            case 'q':
+                if (get_q_list (optarg, v_q) == EXIT_FAILURE)
+                    return (usage (progname, "bad list of quantiles"));
+                break;
+            case 'r':
+                rows_fname = optarg;                                   break;
+            case 'u':
+                hi = stod (optarg);                                    break;
+            case '?':
+                return (usage (progname, "unknown option"));
+            }
+        } catch (const std::exception &e) {
+            return (usage (progname, "bad number for option"));
+        }
+    }
+    if ((argc - optind) < 1)
+        return (usage (progname, "too few arguments"));
+    if (n_bin == 0 || !(hi > lo))
+        return (usage (progname, "need at least one bin and lo < hi"));
+    const char *dist_fname = argv[optind++];
+
+    dist_stat stat (n_bin, lo, hi);
+    dm_opt d_opt;
+    d_opt.stat = &stat;
+    vector<string> v_rows;
+    if (rows_fname) {
+        if (get_rows (rows_fname, v_rows) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        d_opt.rows = &v_rows;
+    }
+    vector<string> v_cmt;
+    if (read_dist_stat (dist_fname, d_opt, v_cmt) == EXIT_FAILURE)
+        return (bust (progname, "failed reading distances from", dist_fname, 0));
+
+    const size_t n = stat.get_n();
+    cout << "# " << dist_fname << ": " << v_cmt.size() << " sequences, "
+         << n << " distances\n";
+    if (stat.get_n_nan())
+        cout << "# " << stat.get_n_nan() << " distances were not numbers\n";
+    if (n == 0)
+        return EXIT_SUCCESS;
+    cout << "# min " << stat.get_min() << " max " << stat.get_max()
+         << " mean " << stat.get_mean() << '\n'
+         << "# fraction   distance\n";
+    stat.write_quantiles (cout, v_q);
+    if (hist) {
+        cout << "\n# bin_lo     bin_hi        count   cum_frac\n";
+        stat.write_hist (cout);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/*
+ * 19 Oct 2026
+ * External sort for distance matrices that do not fit in memory.
+ * While the matrix is read, entries are collected into a buffer.
+ * When it is full, it is sorted and written to a scratch file.
+ * At the end we do a k-way merge of the runs. If there are so many
+ * runs that we cannot give each a reasonable buffer, we first merge
+ * groups of them into longer runs.
+ * Memory use is bounded by max_ent entries, not by the size of the
+ * matrix.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "dm_runs.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const size_t MIN_RUN_BUF = 1024; /* entries, when merging */
+
+/* ---------------- dm_runs::dm_runs -------------------------
+ */
+dm_runs::dm_runs (const char *scratch_dir, const size_t max)
+{
+    dir = scratch_dir;
+    max_ent = max;
+    if (max_ent < 2 * MIN_RUN_BUF)
+        max_ent = 2 * MIN_RUN_BUF;
+    n_ent = 0;
+}
+
+/* ---------------- dm_runs::~dm_runs ------------------------
+ */
+dm_runs::~dm_runs ()
+{
+    for (run &r : v_run)
+        close (r.fd);
+}
+
+/* ---------------- new_run_file -----------------------------
+ * Make a scratch file and unlink it straight away. It lives as
+ * long as we keep the descriptor.
+ */
+int
+dm_runs::new_run_file ()
+{
+    string t = dir + "/dm_runXXXXXX";
+    vector<char> path (t.begin(), t.end());
+    path.push_back ('\0');
+    const int fd = mkstemp (path.data());
+    if (fd < 0) {
+        bust_void (__func__, "making scratch file in", dir.c_str(), ":", strerror(errno), 0);
+        return -1;
+    }
+    unlink (path.data());
+    return fd;
+}
+
+/* ---------------- write_run --------------------------------
+ */
+int
+dm_runs::write_run (const int fd, const dist_entry *d, const size_t n)
+{
+    const char *p = reinterpret_cast<const char *>(d);
+    size_t to_go = n * sizeof (dist_entry);
+    while (to_go) {
+        const ssize_t got = write (fd, p, to_go);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return (bust (__func__, "writing scratch file in", dir.c_str(), ":", strerror(errno), 0));
+        }
+        p += got;
+        to_go -= size_t (got);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- spill ------------------------------------
+ * Sort the entries, write them as a new run and empty the
+ * vector, so the caller can fill it again.
+ */
+int
+dm_runs::spill (vector<dist_entry> &v)
+{
+    std::sort (v.begin(), v.end(), dist_ent_cmp);
+    const int fd = new_run_file();
+    if (fd < 0)
+        return EXIT_FAILURE;
+    if (write_run (fd, v.data(), v.size()) == EXIT_FAILURE) {
+        close (fd);
+        return EXIT_FAILURE;
+    }
+    run r;
+    r.fd = fd;
+    r.n = v.size();
+    r.done = 0;
+    r.b_pos = 0;
+    v_run.push_back (r);
+    n_ent += v.size();
+    v.clear();
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- refill -----------------------------------
+ * Read the next piece of a run into its buffer. Return false
+ * if the run is finished.
+ */
+bool
+dm_runs::refill (run &r, const size_t bufsiz)
+{
+    if (r.done == r.n)
+        return false;
+    size_t n = r.n - r.done;
+    if (n > bufsiz)
+        n = bufsiz;
+    r.buf.resize (n);
+    char *p = reinterpret_cast<char *>(r.buf.data());
+    size_t to_go = n * sizeof (dist_entry);
+    off_t off = off_t (r.done * sizeof (dist_entry));
+    while (to_go) {
+        const ssize_t got = pread (r.fd, p, to_go, off);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            throw runtime_error (string (__func__) + ": reading scratch file in " + dir);
+        p += got;
+        off += got;
+        to_go -= size_t (got);
+    }
+    r.done += n;
+    r.b_pos = 0;
+    return true;
+}
+
+/* ---------------- run_later --------------------------------
+ * std::push_heap() builds a max-heap, so the run whose current
+ * entry comes later in the order has to compare as "smaller".
+ */
+bool
+dm_runs::run_later (const unsigned a, const unsigned b) const
+{
+    const run &r_a = v_run[a];
+    const run &r_b = v_run[b];
+    return dist_ent_cmp (r_b.buf[r_b.b_pos], r_a.buf[r_a.b_pos]);
+}
+
+/* ---------------- next -------------------------------------
+ * Pop the smallest entry off the heap of runs.
+ */
+bool
+dm_runs::next (dist_entry &d_e)
+{
+    if (heap.empty())
+        return false;
+    auto later = [this] (const unsigned a, const unsigned b) { return run_later (a, b);};
+    pop_heap (heap.begin(), heap.end(), later);
+    const unsigned r_ndx = heap.back();
+    run &r = v_run[r_ndx];
+    d_e = r.buf[r.b_pos++];
+    if (r.b_pos == r.buf.size() && !refill (r, r.buf.size())) {
+        heap.pop_back();
+    } else {
+        push_heap (heap.begin(), heap.end(), later);
+    }
+    return true;
+}
+
+/* ---------------- merge_pass -------------------------------
+ * Merge the first fan_in runs into one new run at the end of
+ * the list.
+ */
+int
+dm_runs::merge_pass (const size_t fan_in)
+{
+    const size_t bufsiz = max_ent / (fan_in + 1);
+    const int fd = new_run_file();
+    if (fd < 0)
+        return EXIT_FAILURE;
+    auto later = [this] (const unsigned a, const unsigned b) { return run_later (a, b);};
+    heap.clear();
+    for (unsigned i = 0; i < fan_in; i++) {
+        v_run[i].done = 0;
+        if (refill (v_run[i], bufsiz)) {
+            heap.push_back (i);
+            push_heap (heap.begin(), heap.end(), later);
+        }
+    }
+    vector<dist_entry> out;
+    out.reserve (bufsiz);
+    size_t n_out = 0;
+    for (dist_entry d_e; next (d_e); ) {
+        out.push_back (d_e);
+        if (out.size() == bufsiz) {
+            if (write_run (fd, out.data(), out.size()) == EXIT_FAILURE) {
+                close (fd);
+                return EXIT_FAILURE;
+            }
+            n_out += out.size();
+            out.clear();
+        }
+    }
+    if (write_run (fd, out.data(), out.size()) == EXIT_FAILURE) {
+        close (fd);
+        return EXIT_FAILURE;
+    }
+    n_out += out.size();
+    for (unsigned i = 0; i < fan_in; i++)
+        close (v_run[i].fd);
+    v_run.erase (v_run.begin(), v_run.begin() + long (fan_in));
+    run r;
+    r.fd = fd;
+    r.n = n_out;
+    r.done = 0;
+    r.b_pos = 0;
+    v_run.push_back (r);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- start ------------------------------------
+ * Get ready to hand out entries from the beginning. This can be
+ * called again to walk the entries a second time.
+ */
+int
+dm_runs::start ()
+{
+    size_t fan_in = max_ent / MIN_RUN_BUF;
+    if (fan_in < 2)
+        fan_in = 2;
+    while (v_run.size() > fan_in)
+        if (merge_pass (fan_in) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    for (run &r : v_run) {      /* give the memory back from merging */
+        r.buf.clear();
+        r.buf.shrink_to_fit();
+    }
+
+    auto later = [this] (const unsigned a, const unsigned b) { return run_later (a, b);};
+    heap.clear();
+    if (v_run.empty())
+        return EXIT_SUCCESS;
+    const size_t bufsiz = max_ent / v_run.size();
+    for (unsigned i = 0; i < v_run.size(); i++) {
+        v_run[i].done = 0;
+        if (refill (v_run[i], bufsiz)) {
+            heap.push_back (i);
+            push_heap (heap.begin(), heap.end(), later);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- scan -------------------------------------
+ * Hand every entry in every run to f, in no special order, until
+ * f returns true. Return true if f stopped us.
+ * This does not disturb a merge that is running.
+ */
+bool
+dm_runs::scan (bool (*f) (const dist_entry &, void *), void *arg) const
+{
+    static const size_t SCAN_BUF = 65536;
+    vector<dist_entry> buf (SCAN_BUF);
+    for (const run &r : v_run) {
+        for (size_t done = 0; done < r.n; ) {
+            size_t n = r.n - done;
+            if (n > SCAN_BUF)
+                n = SCAN_BUF;
+            const size_t nbyte = n * sizeof (dist_entry);
+            const off_t off = off_t (done * sizeof (dist_entry));
+            if (pread (r.fd, buf.data(), nbyte, off) != ssize_t (nbyte))
+                throw runtime_error (string (__func__) + ": reading scratch file in " + dir);
+            for (size_t i = 0; i < n; i++)
+                if (f (buf[i], arg))
+                    return true;
+            done += n;
+        }
+    }
+    return false;
+}
+
+/* ---------------- find_pair --------------------------------
+ * Look for one pair of nodes by reading through every run. This
+ * is slow, but only used for a few distances at the end.
+ */
+struct pair_want {
+    unsigned node1, node2;
+    float dist;
+};
+static bool
+pair_match (const dist_entry &d_e, void *arg)
+{
+    pair_want *p = static_cast<pair_want *>(arg);
+    if (((d_e.ndx1 == p->node1) && (d_e.ndx2 == p->node2)) ||
+        ((d_e.ndx1 == p->node2) && (d_e.ndx2 == p->node1))) {
+        p->dist = d_e.dist;
+        return true;
+    }
+    return false;
+}
+
+bool
+dm_runs::find_pair (const unsigned node1, const unsigned node2, float *dist) const
+{
+    pair_want p = {node1, node2, 0.0};
+    if (! scan (pair_match, &p))
+        return false;
+    *dist = p.dist;
+    return true;
+}
@@ -0,0 +1,63 @@
+/*
+ * 19 Oct 2026
+ * Sorted runs of distance entries, spilled to a scratch directory
+ * and merged back as one ascending stream.
+ * Can only be included after <string>, <vector> and distmat_rd.hh
+ */
+#ifndef DM_RUNS_HH
+#define DM_RUNS_HH
+
+#ifdef __clang__
+#    pragma clang diagnostic push
+#    pragma clang diagnostic ignored "-Wpadded"
+#endif /* clang */
+
+/* ---------------- dm_runs ----------------------------------
+ * The caller fills a vector with at most max_ent entries and
+ * hands it to spill(). We sort it and write it to an anonymous
+ * file (unlinked as soon as it is opened, so nothing is left
+ * lying around if we crash). start() merges runs until few
+ * enough are left to merge within max_ent, then next() hands
+ * back entries one at a time.
+ * We use pread(), so nobody shares a file offset and scan() or
+ * find_pair() can read while a merge is running.
+ */
+class dm_runs {
+private:
+    struct run {
+        int fd;
+        size_t n;                     /* entries in the file */
+        size_t done;                  /* entries read back so far */
+        std::vector<dist_entry> buf;
+        size_t b_pos;
+    };
+    std::vector<run> v_run;
+    std::vector<unsigned> heap;       /* indices into v_run */
+    std::string dir;
+    size_t max_ent;                   /* memory budget, in entries */
+    size_t n_ent;
+    int new_run_file ();
+    int write_run (const int fd, const dist_entry *d, const size_t n);
+    bool refill (run &r, const size_t bufsiz);
+    bool run_later (const unsigned a, const unsigned b) const;
+    int merge_pass (const size_t fan_in);
+    dm_runs (const dm_runs &);
+    dm_runs &operator= (const dm_runs &);
+public:
+    dm_runs (const char *dir, const size_t max_ent);
+    ~dm_runs ();
+    size_t get_max_ent() const { return max_ent;}
+    size_t n_run () const { return v_run.size();}
+    size_t size () const { return n_ent;}
+    int spill (std::vector<dist_entry> &v);
+    int start ();
+    bool next (dist_entry &d_e);
+    bool scan (bool (*f) (const dist_entry &, void *), void *arg) const;
+    bool find_pair (const unsigned ndx1, const unsigned ndx2, float *dist) const;
+};
+
+#ifdef __clang__
+#    pragma clang diagnostic pop
+#endif /* clang */
+
+#endif /* DM_RUNS_HH */
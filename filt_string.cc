@@ -3,10 +3,17 @@
  * We want to
  *  1. set up a bit vector for all positions in a string which are not gaps and
  *  2. use this filter to remove all the positions which are not set.
+ * 19 Oct 2026
+ * The bit vector is packed, 64 columns to a word, so many sequences
+ * can be ORed in cheaply. Columns are removed by copying the runs
+ * of columns we keep, rather than looking at each character.
  */
 
+#include <algorithm>
+#include <bitset>
 #include <cctype>
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <exception>
 #include <fstream>
@@ -72,45 +79,135 @@ main()
 
 #endif /* check_white_start_end */
 
-/* ---------------- set_vec  ---------------------------------
- * Given a vector and a string, walk down the string. If a
- * character is not a gap, set the entry in the vector.
- * This function does not currently check if the vectors are the
- * same size. Perhaps it should and then throw an exception if
- * they differ.
+/* ---------------- or_nongap  ------------------------------
+ * Given a mask and a string, walk down the string. If a
+ * character is not a gap, set the bit in the mask. The mask
+ * should have room for (s.size() + 63) / 64 words. Anything
+ * beyond the mask is ignored.
+ * The inner loop has no branches, so the compiler can do 64
+ * characters with vector compares.
  */
 void
-set_vec (const std::string &s, vector<bool> &v)
+or_nongap (const std::string &s, vector<uint64_t> &mask)
 {
-    string::const_iterator s_it = s.begin();
-    vector<bool>::iterator v_it = v.begin();
-    for ( ; s_it != s.end(); s_it++, v_it++)
-        if (*s_it != GAPCHAR)
-            if (! *v_it)
-                *v_it = true;
+    const size_t len = min (s.size(), mask.size() * 64);
+    const char *p = s.data();
+    size_t w = 0;
+    for ( ; (w + 1) * 64 <= len; w++, p += 64) {
+        uint64_t bits = 0;
+        for (unsigned j = 0; j < 64; j++)
+            bits |= uint64_t (p[j] != GAPCHAR) << j;
+        mask[w] |= bits;
+    }
+    for (size_t i = w * 64; i < len; i++)
+        if (s[i] != GAPCHAR)
+            mask[i / 64] |= uint64_t (1) << (i % 64);
 }
 
-/* ---------------- squash_string_vec ------------------------
- * Given a string and a vector of bools, walk down the string
- * and copy those positions where the boolean is true.
+/* ---------------- or_mask ----------------------------------
+ * dst |= src, word by word.
  */
-std::string
-squash_string_vec (std::string &s, const vector<bool> &v)
+void
+or_mask (const vector<uint64_t> &src, vector<uint64_t> &dst)
+{
+    const size_t n = min (src.size(), dst.size());
+    for (size_t w = 0; w < n; w++)
+        dst[w] |= src[w];
+}
+
+/* ---------------- runs_or_mask -----------------------------
+ * run holds lengths of alternating runs of gaps and residues,
+ * starting with gaps. Set the bits of the residues.
+ */
+void
+runs_or_mask (const vector<uint32_t> &run, vector<uint64_t> &mask)
 {
-    if (v.size() != s.size()) {
-        std::cerr << __func__<< ": programming mistake. String and vector sizes are different. "
-                  << s.size() << " != "<<v.size()<< "\n";
-        return string ("");
+    size_t pos = 0;
+    for (size_t k = 0; k < run.size(); k++) {
+        const size_t end = min (pos + run[k], mask.size() * 64);
+        if (k % 2) {
+            size_t i = pos;
+            for ( ; i < end && i % 64; i++)
+                mask[i / 64] |= uint64_t (1) << (i % 64);
+            for ( ; i + 64 <= end; i += 64)
+                mask[i / 64] = ~uint64_t (0);
+            for ( ; i < end; i++)
+                mask[i / 64] |= uint64_t (1) << (i % 64);
+        }
+        pos += run[k];
     }
-    string new_s;
-    new_s.reserve(v.size());
-    std::vector<bool>::const_iterator v_it = v.begin();
+}
 
-    for( std::string::iterator s_it=s.begin(); s_it!=s.end(); ++s_it, ++v_it)
-        if (*v_it)
-            new_s += *s_it;
-    s = new_s;
-    return s;
+/* ---------------- mask_count -------------------------------
+ * How many bits are set ?
+ */
+size_t
+mask_count (const vector<uint64_t> &mask)
+{
+    size_t n = 0;
+    for (const uint64_t w : mask)
+        n += bitset<64> (w).count();
+    return n;
+}
+
+/* ---------------- mask_runs --------------------------------
+ * Turn the first len bits of a mask into lengths of alternating
+ * runs of clear and set bits, starting with clear (maybe zero of
+ * them). Whole words of the same bit are done in one step.
+ */
+void
+mask_runs (const vector<uint64_t> &mask, const size_t len, vector<uint32_t> &run)
+{
+    run.clear();
+    bool in_set = false;
+    uint32_t n = 0;
+    for (size_t i = 0; i < len; ) {
+        const uint64_t w = mask[i / 64];
+        const uint64_t all = in_set ? ~uint64_t (0) : 0;
+        if (i % 64 == 0 && i + 64 <= len && w == all) {
+            n += 64;
+            i += 64;
+            continue;
+        }
+        const bool set = (w >> (i % 64)) & 1;
+        if (set != in_set) {
+            run.push_back (n);
+            n = 0;
+            in_set = set;
+        }
+        n++;
+        i++;
+    }
+    run.push_back (n);
+}
+
+/* ---------------- squash_runs ------------------------------
+ * Given a string and runs from mask_runs(), keep only the
+ * characters in the runs of set bits. Each run is one block
+ * copy. If the runs do not cover the string, complain and
+ * leave the string empty.
+ */
+void
+squash_runs (std::string &s, const vector<uint32_t> &run)
+{
+    size_t tot = 0;
+    for (const uint32_t r : run)
+        tot += r;
+    if (tot != s.size()) {
+        std::cerr << __func__<< ": programming mistake. String and mask sizes are different. "
+                  << s.size() << " != "<< tot << "\n";
+        s.clear();
+        return;
+    }
+    string new_s;
+    new_s.reserve (s.size());
+    size_t pos = 0;
+    for (size_t k = 0; k < run.size(); k++) {
+        if (k % 2)
+            new_s.append (s, pos, run[k]);
+        pos += run[k];
+    }
+    s.swap (new_s);
 }
 
 #undef test_me
@@ -135,15 +232,15 @@ int main ()
         infile.seekg (pos);
     }
     infile.seekg(0);
-    vector<bool> v(len, false);
+    vector<uint64_t> v((len + 63) / 64, 0);
     cout<< __func__ << " len is "<< len << " and sizeof vector is "<< sizeof(v) << "\n";
     for (fseq fs(infile, len); fs.get_seq().size(); fs.fill(infile, len))
-        set_vec (fs.get_seq(), v);
-
-    v.shrink_to_fit();
+        or_nongap (fs.get_seq(), v);
 
-    for (vector<bool>::const_iterator t = v.begin(); t != v.end(); t++)
-        cout << *t;    
+    vector<uint32_t> run;
+    mask_runs (v, len, run);
+    for (size_t k = 0; k < run.size(); k++)
+        cout << string (run[k], k % 2 ? '1' : '0');
     cout << '\n';
 
     infile.close();
@@ -152,10 +249,10 @@ int main ()
         cout<< __func__<< ": before squash\n" <<
             fs.get_seq()<< '\n';
         string s = fs.get_seq();
-        s = squash_string_vec (s, v);
+        squash_runs (s, run);
         if ( ! s.length())
             return EXIT_FAILURE;
-        fs.replace_seq (squash_string_vec (s, v));
+        fs.replace_seq (s);
     }
         cout << __func__<< ": after\n" << fs.get_seq() << "\n";
     }
@@ -1,10 +1,15 @@
 /* 22 Jun 2016
+ * Can only be included after <cstdint>, <string> and <vector>
  */
 #ifndef FILT_STRING_HH
 #define FILT_STRING_HH
 
-void set_vec (const std::string &s, std::vector<bool> &v);
-std::string squash_string_vec (std::string &s, const std::vector<bool> &v);
+void or_nongap (const std::string &s, std::vector<uint64_t> &mask);
+void or_mask (const std::vector<uint64_t> &src, std::vector<uint64_t> &dst);
+void runs_or_mask (const std::vector<uint32_t> &run, std::vector<uint64_t> &mask);
+size_t mask_count (const std::vector<uint64_t> &mask);
+void mask_runs (const std::vector<uint64_t> &mask, const size_t len, std::vector<uint32_t> &run);
+void squash_runs (std::string &s, const std::vector<uint32_t> &run);
 std::string rmv_white_start_end (std::string &s);
 
 #define FILT_STRING_SIZE_WRONG 
@@ -7,11 +7,13 @@
  * are within the space
  */
 
+#include <cstdint>
 #include <cstring> /* strerror */
 #include <fstream>
 #include <future>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <utility> /* used by seq_index */
 #include <string>
 #include <unordered_map>
@@ -25,6 +27,7 @@
 #include "fseq.hh"
 #include "graphmisc.hh"
 #include "mgetline.hh"
+#include "msa_dist.hh"
 #include "pathprint.hh"
 #include "prog_bug.hh"
 #include "seq_index.hh"
@@ -46,8 +49,9 @@ static int
 usage (const char *progname, const char *s)
 {
     static const char *u
-        = "[-p seqs_on_path_fname] [-s seq_out_fname]\n\
-           [-u unloved_seqs] interesting_seq_file dist_mat_file [seq_in_fname]\n";
+        = "[-d max_dist] [-m mem_MB] [-p seqs_on_path_fname] [-q half|fixed] [-r rows_fname]\n\
+           [-s seq_out_fname] [-t scratch_dir] [-u unloved_seqs] interesting_seq_file dist_mat_file [seq_in_fname]\n\
+   or  [-P skip|diff] [other options] interesting_seq_file seq_in_fname\n";
     cerr << progname << ": "<< s<<'\n';
     return (bust (progname, u, NULL));
 }
@@ -211,8 +215,7 @@ which_component (const vector<component> &all_graphs, const unsigned node_ndx)
  * return it.
  */
 static component
-get_edges (const vector<unsigned> &v_spec_ndx,
-           const vector<struct dist_entry> &dist_mat_ent)
+get_edges (const vector<unsigned> &v_spec_ndx, dist_mat &d_m)
 {
     vector<component> all_graphs;
     /* We keep a list of nodes we have seen. If a node has not been seen
@@ -245,11 +248,12 @@ get_edges (const vector<unsigned> &v_spec_ndx,
 
     vector<unsigned> v_to_find = v_spec_ndx; /* set of special nodes */
     v_to_find.erase (v_to_find.begin());
-    vector<struct dist_entry>::const_iterator d_it = dist_mat_ent.begin();
-    for (; d_it < dist_mat_ent.end() && v_to_find.size() > 0; d_it++) {
-        const unsigned first  = d_it->ndx1;
-        const unsigned second = d_it->ndx2;
-        const float dist      = d_it->dist;
+    const dist_mat::edge_iter d_end = d_m.end();
+    dist_mat::edge_iter d_it = d_m.begin();
+    for (; d_it != d_end && v_to_find.size() > 0; ++d_it) {
+        const unsigned first  = d_it.ndx1();
+        const unsigned second = d_it.ndx2();
+        const float dist      = d_it.dist();
         unsigned char nfound = 0; /* can only have values 0, 1 or 2 */
         unsigned c_ndx_1 = 0, c_ndx_2 = 0;
         bool first_known, second_known;
@@ -332,7 +336,7 @@ get_edges (const vector<unsigned> &v_spec_ndx,
 void
 component::describe (const dist_mat &d_m)
 {
-    vector<string>::size_type n = d_m.get_n_mem();
+    const size_t n = d_m.get_n_file_row();
     cout << "The connected component has " << this->get_n_node()
          << " sequences and "<< this->get_n_edge()<< " edges.\n"
          << "The original distance matrix had " << n << " sequences and "
@@ -647,17 +651,55 @@ main ( int argc, char *argv[])
                *unloved_fname = NULL; /* Where we  write unloved seqs */
     int c;
     int n_arg = 2;
-    while ((c = getopt (argc, argv, "p:s:u:")) != -1)
+    dm_opt d_opt;
+    pd_opt p_opt;
+    const char *pd_mode = NULL;
+    const char *rows_fname = NULL;
+    vector<string> v_rows;
+    while ((c = getopt (argc, argv, "d:m:p:P:q:r:s:t:u:")) != -1)
         switch (c)
             {
+            case 'd':
+                try {
+                    d_opt.max_dist = stof (optarg);
+                } catch (const std::exception &e) {
+                    return (usage(progname, "bad maximum distance"));
+                }
+                if (!(d_opt.max_dist >= 0))
+                    return (usage(progname, "maximum distance (-d) must not be negative"));
+                                                                   break;
+            case 'm': {
+                double mem_mb = 0.0;
+                try {
+                    mem_mb = stod (optarg);
+                } catch (const std::exception &e) {
+                    return (usage(progname, "bad memory size"));
+                }
+                if (!(mem_mb > 0) || mem_mb * 1024 * 1024 >= double (numeric_limits<size_t>::max()))
+                    return (usage(progname, "memory size (-m) must be more than zero and less than the address space"));
+                d_opt.mem_budget = size_t (mem_mb * 1024 * 1024);
+            }                                                      break;
             case 'p': path_seq_fname = optarg;                     break;
+            case 'P': pd_mode        = optarg;                     break;
+            case 'r': rows_fname     = optarg;                     break;
+            case 'q':
+                if (str_to_pack (optarg, d_opt.pack) == EXIT_FAILURE) {
+                    return (usage(progname, "bad -q option"));
+                }                                                  break;
             case 's': seq_out_fname  = optarg;                     break;
+            case 't': d_opt.scratch_dir = optarg;                  break;
             case 'u': unloved_fname  = optarg;                     break;
             case '?': return (usage(progname, "unknown option"));
             }
 
-    if (seq_out_fname || path_seq_fname || unloved_fname)
+    if (pd_mode) {  /* the alignment is also where we get sequences */
+        if (strcmp (pd_mode, "diff") == 0)
+            p_opt.gap_diff = true;
+        else if (strcmp (pd_mode, "skip") != 0)
+            return (usage(progname, "-P wants \"skip\" or \"diff\""));
+    } else if (seq_out_fname || path_seq_fname || unloved_fname) {
         n_arg++;
+    }
 
     if ((argc - optind) < n_arg)
         return (usage(progname, "Too few arguments"));
@@ -665,6 +707,8 @@ main ( int argc, char *argv[])
     special_seq_fname     = argv[optind++];
     mat_in_fname  = argv[optind++];
     seq_in_fname = argv[optind++];
+    if (pd_mode)
+        seq_in_fname = mat_in_fname;
 
     /* If we need a seq_index, start building it in the background. */
     packaged_task<seq_index (const char *)> build_s_i_tsk(build_s_i);
@@ -680,13 +724,45 @@ main ( int argc, char *argv[])
         s_i_thread.join();
         return EXIT_FAILURE;
     }
-    dist_mat d_m(mat_in_fname);
-    if (d_m.fail())
+    if (rows_fname) {     /* we always need the special sequences */
+        if (get_spec_seqs (rows_fname, v_rows) == 0) {
+            cerr << "No sequences found in " << rows_fname << '\n';
+            if (s_i_thread.joinable())
+                s_i_thread.join();
+            return EXIT_FAILURE;
+        }
+        v_rows.insert (v_rows.end(), v_spec_seqs.begin(), v_spec_seqs.end());
+        d_opt.rows = &v_rows;
+    }
+    unique_ptr<dist_mat> d_m_p;
+    if (pd_mode) {
+        vector<string> v_pd_cmt;
+        vector<float> v_tri;
+        if (msa_pdist (mat_in_fname, p_opt, v_pd_cmt, v_tri) == EXIT_SUCCESS)
+            d_m_p.reset (new dist_mat (v_pd_cmt, v_tri));
+    } else {
+        d_m_p.reset (new dist_mat (mat_in_fname, d_opt));
+    }
+    if (!d_m_p || d_m_p->fail()) {
+        if (s_i_thread.joinable())
+            s_i_thread.join();
         return EXIT_FAILURE;
+    }
+    dist_mat &d_m = *d_m_p;
+    if (d_m.get_pack() != PACK_NONE)
+        cout << "Distances packed to 16 bits, biggest error " << d_m.get_q_err() << '\n';
     vector<unsigned> v_spec_ndx;
     if (get_special_seq_ndx(d_m.get_cmt_vec(), v_spec_seqs, v_spec_ndx) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    component cmpnt = get_edges (v_spec_ndx, d_m.get_dist());
+    component cmpnt = get_edges (v_spec_ndx, d_m);
+    for (const unsigned v : v_spec_ndx) {  /* only if we dropped edges on reading */
+        if (! cmpnt.has_node (v)) {
+            if (s_i_thread.joinable())
+                s_i_thread.join();
+            return (bust (progname, "special sequences are not connected.",
+                          "Is the maximum distance (-d) too small ?", 0));
+        }
+    }
     cmpnt.describe (d_m);
     seq_index s_i;
     if (s_i_thread.joinable()) {
@@ -694,7 +770,7 @@ main ( int argc, char *argv[])
         s_i = s_i_fut.get();
     }
 
-    future<int> fut_wrt_path = async(std::launch::async, path_printing, cmpnt, d_m, v_spec_ndx, ref(s_i), path_seq_fname);
+    future<int> fut_wrt_path = async(std::launch::async, path_printing, cmpnt, cref(d_m), v_spec_ndx, ref(s_i), path_seq_fname);
     
     vector<bool> v_loved (d_m.get_n_mem(), false);
     if (seq_out_fname || unloved_fname)
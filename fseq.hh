@@ -22,6 +22,7 @@ public:
     void clean (const bool keep_gap, const bool rmv_white);
     std::string const get_cmmt( void ) { return cmmt ;}
     std::string const get_seq( void )  { return seq ;}
+    const std::string &get_seq_ref () const { return seq;}
     size_t get_size() { return seq.size() ;}
     void replace_cmmt (const std::string s) { cmmt = s; };
     void replace_seq  (const std::string s) {seq = s;}
@@ -8,6 +8,7 @@
  * Has it been declared holy ? (To be kept)
  * How long is it ?
  * How many gap characters does it have ?
+ * How many residues are unknown or ambiguous (X, B, Z, U) ?
  * the constructor eats a sequence and fills out the information.
  * The idea is, we will read sequences, then put them in a queue.
  * the queue will spit out comment / property pairs.
@@ -21,17 +22,37 @@ class fseq;
 
 class fseq_prop {
 public:
-    fseq_prop () {ngap = 0; sacred = false; keep = false;}
+    fseq_prop ();
     fseq_prop (fseq&);    
     bool is_sacred() const  { return sacred;}
     void make_sacred ()     { sacred = true; }
     bool to_keep ()         { return keep;}
+    float frac_unknown () const { return f_unknown;}
     unsigned int ngap;
+    float f_unknown;             /* X, B, Z and U over everything that is not a gap */
 private:
     bool sacred;
     bool keep;
 };
 
+/* ---------------- fseq_comp --------------------------------
+ * How much of each of the 20 amino acids, upper or lower
+ * case ? This is for filtering sequences one at a time, so it
+ * is not kept in fseq_prop, of which reduce has a copy for
+ * every sequence.
+ */
+class fseq_comp {
+public:
+    explicit fseq_comp (const fseq&);
+    float frac_unknown () const;
+    float frac_commonest () const;
+    static const unsigned N_AA = 20;
+private:
+    unsigned int nres;
+    unsigned int n_unknown;
+    unsigned int comp[N_AA];
+};
+
 #ifdef __clang__
 #    pragma clang diagnostic pop
 #endif /* clang */
@@ -0,0 +1,335 @@
+/*
+ * 19 Oct 2026
+ * Distances between sequences which are not aligned.
+ * Every k-mer in a sequence is hashed and we keep the sk_size
+ * smallest hashes (a bottom-s MinHash sketch). The fraction of
+ * shared hashes among the smallest sk_size of the union of two
+ * sketches estimates the Jaccard index, j, of the k-mer sets. This
+ * is turned into a distance like Mash does,
+ *     d = -1/k ln (2j / (1 + j))
+ * which is roughly the fraction of sites that differ. No shared
+ * k-mers gives 1.
+ * Sequences are read in batches and each batch is sketched by
+ * several threads. The sketches are small, so we can keep all of
+ * them. Then we either
+ *   - calculate every pair, as for msa_dist, or
+ *   - only look at sequences which share at least one hash, via an
+ *     inverted index, and keep the nearest n_nbor of each. This is
+ *     what lets us reduce very many sequences.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "fseq.hh"
+#include "kmer_sketch.hh"
+#include "tile_dist.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const unsigned N_BATCH  = 4096;   /* sequences sketched together */
+static const unsigned I_CHUNK  = 64;     /* rows handed out at once for neighbours */
+static const size_t   MAX_POST = 5000;   /* ignore hashes found in more sketches */
+static const uint64_t H_MULT   = 0x9e3779b97f4a7c15ULL;
+
+/* ---------------- sketches ---------------------------------
+ * All the sketches, one after the other. Sketch i is in
+ * v_hash [v_off[i]..v_off[i+1]) and is sorted.
+ */
+struct sketches {
+    vector<uint64_t> v_hash;
+    vector<size_t> v_off;
+    sketches () : v_off (1, 0) {}
+    size_t n () const { return v_off.size() - 1;}
+    const uint64_t *begin (const size_t i) const { return v_hash.data() + v_off[i];}
+    size_t size (const size_t i) const { return v_off[i + 1] - v_off[i];}
+};
+
+/* ---------------- mix64 ------------------------------------
+ * Scramble the bits, so that the smallest hashes are a random
+ * sample of k-mers and not, for example, the ones with most
+ * alanines. This is the finaliser from splitmix64.
+ */
+static inline uint64_t
+mix64 (uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/* ---------------- make_sketch ------------------------------
+ * Throw away anything that is not a letter (gaps, white space,
+ * stop codons), so it does not matter if the sequence was
+ * aligned. Hash each k-mer with a rolling polynomial, so each
+ * step is constant work whatever k is.
+ */
+static void
+make_sketch (const string &seq, const unsigned k, const unsigned sk_size,
+             vector<uint64_t> &sk)
+{
+    sk.clear();
+    string r;
+    r.reserve (seq.size());
+    for (const char c : seq)
+        if (isalpha ((unsigned char) c))
+            r += char (toupper ((unsigned char) c));
+    if (r.size() < k)
+        return;
+    uint64_t top = 1;                 /* H_MULT to the power k - 1 */
+    for (unsigned i = 1; i < k; i++)
+        top *= H_MULT;
+    uint64_t h = 0;
+    for (unsigned i = 0; i < k; i++)
+        h = h * H_MULT + uint64_t ((unsigned char) r[i]);
+    sk.reserve (r.size() - k + 1);
+    sk.push_back (mix64 (h));
+    for (size_t i = k; i < r.size(); i++) {
+        h -= top * uint64_t ((unsigned char) r[i - k]);
+        h = h * H_MULT + uint64_t ((unsigned char) r[i]);
+        sk.push_back (mix64 (h));
+    }
+    sort (sk.begin(), sk.end());
+    sk.erase (unique (sk.begin(), sk.end()), sk.end());
+    if (sk.size() > sk_size)
+        sk.resize (sk_size);
+}
+
+/* ---------------- sketch_worker ----------------------------
+ * Take sequences from the batch until there are none left.
+ */
+static void
+sketch_worker (const vector<string> &v_seq, const sk_opt &opt,
+               atomic<size_t> &next, vector<vector<uint64_t>> &v_sk)
+{
+    for (size_t i = next++; i < v_seq.size(); i = next++)
+        make_sketch (v_seq[i], opt.k, opt.sk_size, v_sk[i]);
+}
+
+/* ---------------- read_sketch ------------------------------
+ * Read sequences, in batches, and sketch them. We do not check
+ * lengths, since sequences need not be aligned.
+ */
+static int
+read_sketch (const char *seq_fname, const sk_opt &opt,
+             vector<string> &v_cmt, sketches &sks)
+{
+    if (opt.k == 0 || opt.sk_size == 0)
+        return (bust (__func__, "k-mer length and sketch size must be more than zero", 0));
+    ifstream infile (seq_fname);
+    if (!infile)
+        return (bust (__func__, "opening", seq_fname, strerror(errno), 0));
+    const unsigned n_thread = get_n_thread (opt.n_thread);
+    vector<string> v_seq;
+    vector<vector<uint64_t>> v_sk (N_BATCH);
+    fseq fs;
+    try {
+        bool more = true;
+        while (more) {
+            v_seq.clear();
+            while (v_seq.size() < N_BATCH && (more = fs.fill (infile, 0))) {
+                v_seq.push_back (fs.get_seq());
+                v_cmt.push_back (fs.get_cmmt());
+            }
+            atomic<size_t> next (0);
+            vector<thread> v_thr;
+            for (unsigned t = 1; t < n_thread && t < v_seq.size(); t++)
+                v_thr.push_back (thread (sketch_worker, cref (v_seq), cref (opt),
+                                         ref (next), ref (v_sk)));
+            sketch_worker (v_seq, opt, next, v_sk);
+            for (thread &t : v_thr)
+                t.join();
+            for (size_t i = 0; i < v_seq.size(); i++) {
+                sks.v_hash.insert (sks.v_hash.end(), v_sk[i].begin(), v_sk[i].end());
+                sks.v_off.push_back (sks.v_hash.size());
+            }
+        }
+    } catch (runtime_error &e) {
+        return (bust (__func__, "reading", seq_fname, "\n", e.what(), 0));
+    }
+    if (v_cmt.size() < 2)
+        return (bust (__func__, "need at least two sequences in", seq_fname, 0));
+    v_cmt.shrink_to_fit();
+    sks.v_hash.shrink_to_fit();
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- sk_dist ----------------------------------
+ * Walk along two sorted sketches, looking at the smallest sk_size
+ * hashes of the union and counting how many are in both.
+ */
+static float
+sk_dist (const sketches &sks, const size_t i, const size_t j, const sk_opt &opt)
+{
+    const uint64_t *a = sks.begin (i), *b = sks.begin (j);
+    const size_t na = sks.size (i), nb = sks.size (j);
+    size_t ia = 0, ib = 0, n_union = 0, n_share = 0;
+    while (n_union < opt.sk_size && ia < na && ib < nb) {
+        if (a[ia] < b[ib]) {
+            ia++;
+        } else if (b[ib] < a[ia]) {
+            ib++;
+        } else {
+            n_share++; ia++; ib++;
+        }
+        n_union++;
+    }
+    if (n_share == 0)
+        return 1.0;
+    n_union += min (size_t (opt.sk_size) - n_union, (na - ia) + (nb - ib));
+    const double jac = double (n_share) / double (n_union);
+    const double d = -log (2.0 * jac / (1.0 + jac)) / opt.k;
+    return float (min (d, 1.0));
+}
+
+/* ---------------- sketch_dist ------------------------------
+ * Read sequences and return the names and the upper triangle of
+ * all distances, row by row.
+ */
+int
+sketch_dist (const char *seq_fname, const sk_opt &opt,
+             vector<string> &v_cmt, vector<float> &v_tri)
+{
+    sketches sks;
+    if (read_sketch (seq_fname, opt, v_cmt, sks) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    const unsigned nseq = unsigned (v_cmt.size());
+    try {
+        v_tri.assign (size_t (nseq) * (nseq - 1) / 2, 0.0);
+    } catch (bad_alloc &e) {
+        const string stmp = to_string (nseq);
+        return (bust (__func__, "Broke reserving space for", stmp.c_str(), "seqs", e.what(), 0));
+    }
+    tile_dist (nseq, opt.n_thread, [&] (const unsigned i, const unsigned j) {
+            return sk_dist (sks, i, j, opt);}, v_tri);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- nbor_worker ------------------------------
+ * For each sequence, find every other sequence which shares a hash
+ * (the candidates), get the distance to each and keep the nearest
+ * n_nbor. Hashes that are in very many sketches are skipped, or
+ * this would be quadratic again.
+ */
+static void
+nbor_worker (const sketches &sks, const sk_opt &opt,
+             const vector<pair<uint64_t, unsigned>> &v_post,
+             atomic<size_t> &next, vector<dist_entry> &v_edge)
+{
+    const size_t nseq = sks.n();
+    vector<unsigned> v_cand;
+    vector<pair<float, unsigned>> v_near;
+    for (size_t c = next++; c * I_CHUNK < nseq; c = next++) {
+        const size_t i_end = min (nseq, (c + 1) * I_CHUNK);
+        for (size_t i = c * I_CHUNK; i < i_end; i++) {
+            v_cand.clear();
+            const uint64_t *h = sks.begin (i);
+            for (size_t n = 0; n < sks.size (i); n++) {
+                typedef vector<pair<uint64_t, unsigned>>::const_iterator p_it;
+                const pair<uint64_t, unsigned> key (h[n], 0);
+                const p_it lo = lower_bound (v_post.begin(), v_post.end(), key);
+                p_it hi = lo;
+                while (hi != v_post.end() && hi->first == h[n])
+                    hi++;
+                if (size_t (hi - lo) > MAX_POST)
+                    continue;
+                for (p_it p = lo; p != hi; p++)
+                    if (p->second != i)
+                        v_cand.push_back (p->second);
+            }
+            sort (v_cand.begin(), v_cand.end());
+            v_cand.erase (unique (v_cand.begin(), v_cand.end()), v_cand.end());
+            v_near.clear();
+            for (const unsigned j : v_cand)
+                v_near.push_back (make_pair (sk_dist (sks, i, j, opt), j));
+            const size_t n_keep = min (size_t (opt.n_nbor), v_near.size());
+            partial_sort (v_near.begin(), v_near.begin() + long (n_keep), v_near.end());
+            for (size_t n = 0; n < n_keep; n++) {
+                const unsigned j = v_near[n].second;
+                const unsigned i_u = unsigned (i);
+                v_edge.push_back ({v_near[n].first, min (i_u, j), max (i_u, j)});
+            }
+        }
+    }
+}
+
+/* ---------------- edge_pair_less ---------------------------
+ * Sort edges by their two sequences, so duplicates are together.
+ */
+static bool
+edge_pair_less (const dist_entry &a, const dist_entry &b)
+{
+    if (a.ndx1 != b.ndx1)
+        return a.ndx1 < b.ndx1;
+    return a.ndx2 < b.ndx2;
+}
+
+static bool
+edge_pair_eq (const dist_entry &a, const dist_entry &b)
+{
+    return a.ndx1 == b.ndx1 && a.ndx2 == b.ndx2;
+}
+
+/* ---------------- sketch_nbor ------------------------------
+ * Read sequences and return the names and the edges to the
+ * nearest neighbours of each sequence. If i is near j and j is
+ * near i, the edge is only returned once. Sequences with no
+ * k-mers in common with anybody have no edges at all.
+ */
+int
+sketch_nbor (const char *seq_fname, const sk_opt &opt,
+             vector<string> &v_cmt, vector<dist_entry> &v_edge)
+{
+    sketches sks;
+    if (opt.n_nbor == 0)
+        return (bust (__func__, "programming bug. Zero neighbours asked for", 0));
+    if (read_sketch (seq_fname, opt, v_cmt, sks) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    vector<pair<uint64_t, unsigned>> v_post;     /* inverted index, hash -> seq */
+    v_post.reserve (sks.v_hash.size());
+    for (unsigned i = 0; i < sks.n(); i++)
+        for (size_t n = 0; n < sks.size (i); n++)
+            v_post.push_back (make_pair (sks.begin(i)[n], i));
+    sort (v_post.begin(), v_post.end());
+
+    const unsigned n_thread = get_n_thread (opt.n_thread);
+    vector<vector<dist_entry>> v_part (n_thread);
+    atomic<size_t> next (0);
+    vector<thread> v_thr;
+    for (unsigned t = 0; t < n_thread; t++)
+        v_thr.push_back (thread (nbor_worker, cref (sks), cref (opt), cref (v_post),
+                                 ref (next), ref (v_part[t])));
+    for (thread &t : v_thr)
+        t.join();
+    v_post.clear();
+    v_post.shrink_to_fit();
+
+    v_edge.clear();
+    for (vector<dist_entry> &p : v_part) {
+        v_edge.insert (v_edge.end(), p.begin(), p.end());
+        vector<dist_entry>().swap (p);
+    }
+    sort (v_edge.begin(), v_edge.end(), edge_pair_less);
+    v_edge.erase (unique (v_edge.begin(), v_edge.end(), edge_pair_eq), v_edge.end());
+    v_edge.shrink_to_fit();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,31 @@
+/*
+ * 19 Oct 2026
+ * Alignment free distances from k-mer sketches (MinHash, bottom-s).
+ * Can only be included after <string> and <vector> and distmat_rd.hh
+ */
+#ifndef KMER_SKETCH_HH
+#define KMER_SKETCH_HH
+
+/* ---------------- sk_opt -----------------------------------
+ * k          - k-mer length in residues.
+ * sk_size    - how many of the smallest k-mer hashes we keep
+ *              for each sequence.
+ * n_nbor     - zero means every pair gets a distance. Otherwise
+ *              only keep edges to this many nearest neighbours of
+ *              each sequence.
+ * n_thread   - zero means ask the machine how many it has.
+ */
+struct sk_opt {
+    unsigned k;
+    unsigned sk_size;
+    unsigned n_nbor;
+    unsigned n_thread;
+    sk_opt () : k (8), sk_size (1000), n_nbor (0), n_thread (0) {}
+};
+
+int sketch_dist (const char *seq_fname, const sk_opt &opt,
+                 std::vector<std::string> &v_cmt, std::vector<float> &v_tri);
+int sketch_nbor (const char *seq_fname, const sk_opt &opt,
+                 std::vector<std::string> &v_cmt, std::vector<dist_entry> &v_edge);
+
+#endif /* KMER_SKETCH_HH */
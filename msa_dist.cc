@@ -0,0 +1,173 @@
+/*
+ * 19 Oct 2026
+ * Calculate p-distances between every pair of sequences in a multiple
+ * sequence alignment.
+ * Each residue is turned into a one byte code, with gaps as zero.
+ * Eight codes go into a 64 bit word, so one pass of the inner loop
+ * compares eight columns. For a word from each sequence, we want
+ *   - bytes where the sequences are not gaps and
+ *   - bytes where they differ.
+ * Both are done with the usual word tricks (set the high bit of
+ * every non-zero byte), then we count the high bits. Nothing here
+ * depends on the machine, but compilers are happy to vectorise the
+ * loop.
+ * The pairs are shared out among threads by tile_dist().
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "fseq.hh"
+#include "msa_dist.hh"
+#include "tile_dist.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const uint64_t LO7  = 0x7f7f7f7f7f7f7f7fULL;
+static const uint64_t HI1  = 0x8080808080808080ULL;
+static const uint64_t ONES = 0x0101010101010101ULL;
+
+/* ---------------- res_code ---------------------------------
+ * Gaps are zero. Letters are 1..26, ignoring case. Anything else
+ * is 27. For a distance, we only care if codes are the same.
+ */
+static unsigned char
+res_code (const char c)
+{
+    if (c == '-' || c == '.')
+        return 0;
+    if (isalpha ((unsigned char) c))
+        return (unsigned char) (toupper ((unsigned char) c) - 'A' + 1);
+    return 27;
+}
+
+/* ---------------- read_encode ------------------------------
+ * Read the alignment and store each sequence as n_word words
+ * of codes. The end of the last word is padded with gaps, which
+ * are ignored anyway.
+ */
+static int
+read_encode (const char *msa_fname, vector<string> &v_cmt,
+             vector<uint64_t> &v_code, size_t &n_word)
+{
+    ifstream infile (msa_fname);
+    if (!infile)
+        return (bust (__func__, "opening", msa_fname, strerror(errno), 0));
+    size_t len;
+    { /* look at the first sequence, get the length, so we can check on */
+        streampos pos = infile.tellg();             /* subsequent reads */
+        fseq fs (infile, 0);
+        len = fs.get_seq().size();
+        infile.seekg (pos);
+    }
+    if (len == 0)
+        return (bust (__func__, "no sequences found in", msa_fname, 0));
+    n_word = (len + sizeof (uint64_t) - 1) / sizeof (uint64_t);
+
+    unsigned char code [256];
+    for (unsigned i = 0; i < 256; i++)
+        code[i] = res_code (char (i));
+    vector<unsigned char> row (n_word * sizeof (uint64_t), 0);
+    fseq fs;
+    try {
+        while (fs.fill (infile, len)) {
+            const string s = fs.get_seq();
+            for (size_t i = 0; i < len; i++)
+                row[i] = code [(unsigned char) s[i]];
+            const size_t off = v_code.size();
+            v_code.resize (off + n_word);
+            memcpy (&v_code[off], row.data(), row.size());
+            v_cmt.push_back (fs.get_cmmt());
+        }
+    } catch (runtime_error &e) {
+        return (bust (__func__, "reading", msa_fname, "\n", e.what(), 0));
+    }
+    v_cmt.shrink_to_fit();
+    v_code.shrink_to_fit();
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- nz_bytes ---------------------------------
+ * Set the high bit of every byte that is not zero and clear
+ * everything else.
+ */
+static inline uint64_t
+nz_bytes (const uint64_t x)
+{
+    return (((x & LO7) + LO7) | x) & HI1;
+}
+
+/* ---------------- n_high -----------------------------------
+ * Count high bits, as set by nz_bytes(). Shifting gives 0 or 1
+ * per byte and the multiply adds all the bytes into the top one.
+ */
+static inline unsigned
+n_high (const uint64_t m)
+{
+    return unsigned (((m >> 7) * ONES) >> 56);
+}
+
+/* ---------------- pair_dist --------------------------------
+ * The kernel. gap_diff is a template parameter so the test is
+ * not in the inner loop.
+ */
+template <bool gap_diff>
+static float
+pair_dist (const uint64_t *a, const uint64_t *b, const size_t n_word)
+{
+    unsigned long n_cmp = 0, n_diff = 0;
+    for (size_t w = 0; w < n_word; w++) {
+        const uint64_t na = nz_bytes (a[w]);
+        const uint64_t nb = nz_bytes (b[w]);
+        const uint64_t used = gap_diff ? (na | nb) : (na & nb);
+        n_cmp  += n_high (used);
+        n_diff += n_high (nz_bytes (a[w] ^ b[w]) & used);
+    }
+    if (n_cmp == 0)                  /* nothing in common at all */
+        return 1.0;
+    return float (double (n_diff) / double (n_cmp));
+}
+
+/* ---------------- msa_pdist --------------------------------
+ * Read an alignment and return the names (with the leading ">",
+ * like the rest of the code) and the upper triangle of
+ * distances, row by row, in the order mafft would write them.
+ */
+int
+msa_pdist (const char *msa_fname, const pd_opt &opt,
+           vector<string> &v_cmt, vector<float> &v_tri)
+{
+    vector<uint64_t> v_code;
+    size_t n_word = 0;
+    if (read_encode (msa_fname, v_cmt, v_code, n_word) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    const unsigned nseq = unsigned (v_cmt.size());
+    try {
+        v_tri.assign (size_t (nseq) * (nseq - 1) / 2, 0.0);
+    } catch (bad_alloc &e) {
+        const string stmp = to_string (nseq);
+        return (bust (__func__, "Broke reserving space for", stmp.c_str(), "seqs", e.what(), 0));
+    }
+
+    if (opt.gap_diff)
+        tile_dist (nseq, opt.n_thread, [&] (const unsigned i, const unsigned j) {
+                return pair_dist<true> (&v_code [i * n_word], &v_code [j * n_word], n_word);}, v_tri);
+    else
+        tile_dist (nseq, opt.n_thread, [&] (const unsigned i, const unsigned j) {
+                return pair_dist<false> (&v_code [i * n_word], &v_code [j * n_word], n_word);}, v_tri);
+    return EXIT_SUCCESS;
+}
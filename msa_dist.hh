@@ -0,0 +1,25 @@
+/*
+ * 19 Oct 2026
+ * Pairwise distances calculated directly from a multiple sequence
+ * alignment, so we do not need mafft to write a .hat2 file for us.
+ * Can only be included after <string> and <vector>
+ */
+#ifndef MSA_DIST_HH
+#define MSA_DIST_HH
+
+/* ---------------- pd_opt -----------------------------------
+ * gap_diff   - a residue opposite a gap counts as a difference.
+ *              Otherwise the column is ignored (pairwise deletion).
+ *              Columns with two gaps are always ignored.
+ * n_thread   - zero means ask the machine how many it has.
+ */
+struct pd_opt {
+    bool gap_diff;
+    unsigned n_thread;
+    pd_opt () : gap_diff (false), n_thread (0) {}
+};
+
+int msa_pdist (const char *msa_fname, const pd_opt &opt,
+               std::vector<std::string> &v_cmt, std::vector<float> &v_tri);
+
+#endif /* MSA_DIST_HH */
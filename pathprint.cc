@@ -4,6 +4,7 @@
  */
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
@@ -75,7 +76,7 @@ static const unsigned BSIZ = 512;
   no    dist   dist  prec   o_dist  o_dist
  */
 string
-path::nice_string (const path::node & node) const
+path::nice_string (const path::node & node, const dist_mat &d_m) const
 {
 
     char buf[BSIZ];
@@ -84,7 +85,7 @@ path::nice_string (const path::node & node) const
     if (prec_dist == BAD_DIST) /* This is the source */
         prec_dist = 0.0;
     snprintf (buf, BSIZ - 1, "%8d %8.3g %8.3g %8.3g %8.3g %8.3g\n",
-        node.label + 1, node.src_dist, node.dst_dist, prec_dist, node.orig_src_dist, node.orig_dst_dist);
+        d_m.file_row (node.label) + 1, node.src_dist, node.dst_dist, prec_dist, node.orig_src_dist, node.orig_dst_dist);
     return buf;
 }
 
@@ -118,8 +119,8 @@ path::print (const char *outfile, const dist_mat &d_m) const
             return EXIT_FAILURE;
         ofs_p = &cout;
     }
-    unsigned src_label = nodes.back().label + 1;
-    unsigned dst_label = nodes.front().label + 1;
+    unsigned src_label = d_m.file_row (nodes.back().label) + 1;
+    unsigned dst_label = d_m.file_row (nodes.front().label) + 1;
     *ofs_p << "The path went from seq "<< src_label << " to seq " << dst_label<< '\n';
 
     *ofs_p << txt1;
@@ -132,13 +133,13 @@ path::print (const char *outfile, const dist_mat &d_m) const
     vector<struct node>::const_reverse_iterator v_it = nodes.rbegin();
 
     for( ;v_it != nodes.rend(); v_it++) {
-        string s = nice_string (*v_it);
+        string s = nice_string (*v_it, d_m);
         *ofs_p << s;
     }
 
     *ofs_p << "The set of sequences on the path was\n";
     for ( v_it = nodes.rbegin(); v_it != nodes.rend(); v_it++) {
-        snprintf (buf, BSIZ-1, "%6d ", v_it->label + 1);
+        snprintf (buf, BSIZ-1, "%6d ", d_m.file_row (v_it->label) + 1);
         *ofs_p << buf << d_m.get_cmt(v_it->label) << '\n';
     }
     vector<node> n_copy = nodes;
@@ -149,7 +150,7 @@ path::print (const char *outfile, const dist_mat &d_m) const
     *ofs_p << "Sorted by distance. These are the weakest links:\n";
 
     for (v_it = n_copy.rbegin(); v_it < n_copy.rend() - 1 ; v_it++)
-        *ofs_p << "Seq " << v_it->label + 1 << " to "<< v_it->pred_label + 1
+        *ofs_p << "Seq " << d_m.file_row (v_it->label) + 1 << " to "<< d_m.file_row (v_it->pred_label) + 1
                << " dist "<< v_it->p_dist<< '\n';
     return EXIT_SUCCESS;
 }
@@ -179,7 +180,7 @@ you are using sequences after the alignment, not before.\n";
  
     vector<struct node>::const_reverse_iterator v_it = nodes.rbegin();
     first_size = s_i.get_seq_by_cmmt(d_m.get_cmt(v_it->label)).get_size();
-    vector<bool> v_c_used(first_size, false);
+    vector<uint64_t> v_c_used((first_size + 63) / 64, 0);
 
     try {  /* Next loop visits each node on the path and stores the sequence. */
         for (; v_it != nodes.rend(); v_it++) {     /* We also check if the size is */
@@ -206,11 +207,13 @@ you are using sequences after the alignment, not before.\n";
      */
     if (do_remove_columns) {
         vector<fseq>::iterator f_it = path_seqs.begin();
-        for ( ; f_it != path_seqs.end(); f_it++) /* Build a vector which tells us which */
-            set_vec (f_it->get_seq(), v_c_used); /* columns are used (not gaps) */
+        for ( ; f_it != path_seqs.end(); f_it++) /* Build a mask which tells us which */
+            or_nongap (f_it->get_seq(), v_c_used); /* columns are used (not gaps) */
+        vector<uint32_t> keep_run;
+        mask_runs (v_c_used, first_size, keep_run);
         for (f_it = path_seqs.begin(); f_it != path_seqs.end(); f_it++) {
             string s = f_it->get_seq();
-            squash_string_vec (s, v_c_used);
+            squash_runs (s, keep_run);
             if (! s.length())
                 return EXIT_FAILURE;
             f_it->replace_seq(s);
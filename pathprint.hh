@@ -26,7 +26,7 @@ class seq_index;
 class path {
 private:    
     struct node {
-        unsigned label;      /* Index to node number in original set of seqs */
+        unsigned label;      /* Index to node in the distance matrix */
         unsigned pred_label; /* label of predecessor node in path */
         float src_dist;      /* Distance to source */
         float dst_dist;      /* Distance to dest (last) node */
@@ -35,7 +35,7 @@ private:
         float orig_dst_dist; /* Dist to destination in original distance matrix */
     };
     std::vector<struct node> nodes;
-    std::string nice_string (const node & node) const;
+    std::string nice_string (const node & node, const dist_mat &d_m) const;
     unsigned n_mbr;
 public:
     path (const std::vector<src_dist_t> &, const unsigned,
@@ -0,0 +1,77 @@
+/*
+ * 19 Oct 2026
+ * Read a multiple sequence alignment, calculate the p-distance
+ * between every pair of sequences and write them in mafft's .hat2
+ * format. This is much quicker than running mafft just to get
+ * the distance matrix.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>   /* non standard, but for getopt() */
+#include <vector>
+
+#include "bust.hh"
+#include "distmat_rd.hh"
+#include "distmat_wr.hh"
+#include "msa_dist.hh"
+
+using namespace std;
+
+/* ---------------- usage ------------------------------------ */
+static int usage ( const char *progname, const char *s)
+{
+    static const char *u
+        = " [-b] [-g] [-I] [-n n_thread] in.msa out.hat2\n";
+    return (bust(progname, s, "\n", progname, u, 0));
+}
+
+/* ---------------- main  ------------------------------------ */
+int
+main (int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    bool identity = false;
+    bool binary = false;
+    pd_opt opt;
+    int c;
+    while ((c = getopt (argc, argv, "bgIn:")) != -1) {
+        switch (c) {
+        case 'b':
+            binary = true;                                             break;
+        case 'g':
+            opt.gap_diff = true;                                       break;
+        case 'I':
+            identity = true;                                           break;
+        case 'n':
+            try {
+                opt.n_thread = unsigned (stoul (optarg));
+            } catch (const std::invalid_argument &e) {
+                return (usage (progname, "bad number of threads"));
+            }                                                          break;
+        case '?':
+            return (usage (progname, "unknown option"));
+        }
+    }
+    if ((argc - optind) < 2)
+        return (usage (progname, "too few arguments"));
+    const char *in_fname  = argv[optind++];
+    const char *out_fname = argv[optind++];
+
+    vector<string> v_cmt;
+    vector<float> v_tri;
+    if (msa_pdist (in_fname, opt, v_cmt, v_tri) == EXIT_FAILURE)
+        return (bust (progname, "failed calculating distances from", in_fname, 0));
+    if (identity)
+        for (float &f : v_tri)
+            f = float (1.0 - f);
+    if (binary) {
+        if (write_bin (out_fname, v_cmt, v_tri) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    } else if (write_hat2 (out_fname, v_cmt, v_tri) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -12,24 +12,43 @@
  *   Go back to the MSA, copy entries to keep in to the output file.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <unistd.h>
+#include <memory>
 #include <random>
+#include <sstream>
+#include <thread>
 #include <queue>
+#include <type_traits>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "bust.hh"
+#include "ckpt.hh"
 #include "distmat_rd.hh"
+#include "distmat_wr.hh"
+#include "filt_string.hh"
 #include "fseq.hh"
 #include "fseq_prop.hh"
+#include "kmer_sketch.hh"
 #include "mgetline.hh"
+#include "msa_dist.hh"
 #include "plot_dist_reduce.hh"
+#include "prog_bug.hh"
 #include "t_queue.hh"
+#include "traj.hh"
 
 using namespace std;
 
@@ -44,32 +63,120 @@ static const unsigned char S_1    = 1;
 static const unsigned char S_2    = 2;
 
 static const int DFLT_SEED = 180077;
+static const uint32_t MAX_CKPT_STR = 1 << 20;   /* longest name in a checkpoint */
+static const size_t MEDOID_TASK = 1 << 20;     /* distances looked up per medoid task */
 
+/* ---------------- msa_rec ----------------------------------
+ * With -S, we remember where each record starts in the alignment
+ * and, if we filter columns, which columns it uses. These are
+ * run lengths, alternately gaps and residues, starting with gaps,
+ * which are much smaller than the sequence. If the name comes
+ * again, dup_run has the columns of the later records.
+ */
+struct msa_rec {
+    streamoff off;
+    vector<uint32_t> run;
+    vector<uint32_t> dup_run;
+};
+
+/* ---------------- seq_props --------------------------------
+ * If index is set, get_seq_list() fills rec, so the alignment
+ * never has to be read through again. rec has the first record
+ * with each name and its columns, but also the columns of the
+ * others.
+ */
 struct seq_props {
     map<string, fseq_prop> f_map;
+    unordered_map<string, msa_rec> rec;
     size_t len;
+    size_t n_rec;
+    bool index;
+    bool index_cols;
+    seq_props () : len (0), n_rec (0), index (false), index_cols (false) {}
+};
+
+/* ---------------- seq_at -----------------------------------
+ * A sequence and where it started, on its way through the queue.
+ */
+struct seq_at {
+    fseq fs;
+    streamoff off;
 };
 
 /* ---------------- usage ------------------------------------ */
 static int usage ( const char *progname, const char *s)
 {
     static const char *u
-        = ": [-fgsv -a sacred_file -c choice -e seed -p plot_data_filename] mult_seq_align.msa \
-dist_mat.hat2 outfile.msa n_to_keep";
+        = ": [-fgsv -a sacred_file -B dist_out.bin -c choice -d cutoff -e seed -m mem_MB -o dist_out.hat2\
+ -p plot_data_filename -q half|fixed -S -t scratch_dir -G max_gap -C col_map -k ckpt_dir] mult_seq_align.msa dist_mat.hat2 outfile.msa n_to_keep\n\
+   or  [-P skip|diff] [other options] mult_seq_align.msa outfile.msa n_to_keep\n\
+   or  [-K kmer_len [-N n_nbor]] [other options] seqs.fa outfile.fa n_to_keep\n\
+   or  -R trajectory [-d cutoff -fgiSv] mult_seq_align.msa out1.msa,out2.msa,.. n1,n2,..\n\
+   or  -E n_runs [-O out_stem] [other options] mult_seq_align.msa dist_mat.hat2 freq_out n_to_keep\n\
+   or  -I prev_ckpt_dir -U new_dist [other options] mult_seq_align.msa outfile.msa n_to_keep\n\
+   or  -L clusters [other options] mult_seq_align.msa dist_mat.hat2 outfile.msa n_to_keep\n\
+ outfile.msa and n_to_keep may be comma separated lists of the same length.\n\
+ With -d, n_to_keep may be left out. -T trajectory saves the order of removal.";
     return (bust(progname, s, "\n", progname, u, 0));
 }
 
+/* ---------------- runs_from_seq ----------------------------
+ * Lengths of the runs of gaps and residues in s, starting with
+ * gaps (maybe zero of them).
+ */
+static void
+runs_from_seq (const string &s, vector<uint32_t> &run)
+{
+    vector<uint64_t> mask ((s.size() + 63) / 64, 0);
+    or_nongap (s, mask);
+    mask_runs (mask, s.size(), run);
+    run.shrink_to_fit();
+}
+
+/* ---------------- add_rec ----------------------------------
+ * Note where this record is and which columns it uses. If the
+ * name came before, keep the first place, but add the columns to
+ * dup_run, since every record with the name is used for
+ * filtering. Only the first is counted when trimming, since it
+ * is the one written.
+ */
+static void
+add_rec (seq_props &s_props, fseq &fs, const streamoff off)
+{
+    s_props.n_rec++;
+    const pair<unordered_map<string, msa_rec>::iterator, bool> r
+        = s_props.rec.insert (make_pair (fs.get_cmmt(), msa_rec()));
+    msa_rec &m_r = r.first->second;
+    if (r.second)
+        m_r.off = off;
+    if (! s_props.index_cols)
+        return;
+    if (r.second) {
+        runs_from_seq (fs.get_seq(), m_r.run);
+        return;
+    }
+    const string &s = fs.get_seq_ref();
+    vector<uint64_t> mask ((s.size() + 63) / 64, 0);
+    runs_or_mask (m_r.dup_run, mask);
+    or_nongap (s, mask);
+    mask_runs (mask, s.size(), m_r.dup_run);
+    m_r.dup_run.shrink_to_fit();
+}
+
 /* ---------------- from_queue -------------------------------
  * We have bundles of sequences in a vector. Pull each from
  * the queue
  */
 static void
-from_queue (t_queue <fseq> &q_fs, map<string, fseq_prop> &f_map)  {
+from_queue (t_queue <seq_at> &q_fs, seq_props &s_props)  {
     unsigned n = 0;
+    map<string, fseq_prop> &f_map = s_props.f_map;
     while (q_fs.alive()) {
-        fseq fs = q_fs.front_and_pop();
-        fseq_prop f_p (fs);
-        f_map [fs.get_cmmt()] = f_p;
+        seq_at s_a = q_fs.front_and_pop();
+        fseq_prop f_p (s_a.fs);
+        f_map [s_a.fs.get_cmmt()] = f_p;
+        if (s_props.index)
+            add_rec (s_props, s_a.fs, s_a.off);
         n++;
     }
     cout << __func__ << " read "<< n<< " seqs\n";
@@ -80,6 +187,7 @@ from_queue (t_queue <fseq> &q_fs, map<string, fseq_prop> &f_map)  {
  * just fill out the information.
  * If we are going to put this in a thread, we have to catch exceptions
  * here
+ * If s_props.index is set, note where each record starts.
  */
 static void
 get_seq_list (struct seq_props & s_props, const char *in_fname,
@@ -99,17 +207,23 @@ get_seq_list (struct seq_props & s_props, const char *in_fname,
         infile.seekg (pos);
     }
     s_props.len = len_check;
-    t_queue <fseq> q_fs(N_SEQBUF);
-    thread t1 (from_queue, ref(q_fs), ref(s_props.f_map));
+    t_queue <seq_at> q_fs(N_SEQBUF);
+    thread t1 (from_queue, ref(q_fs), ref(s_props));
 
     {
-        fseq fs;
+        seq_at s_a;
+        s_a.off = 0;
         unsigned scount = 0;
         if (ignore_len_check)
             len_check = 0;
         try {
-            for (; fs.fill(infile, len_check); scount++)
-                q_fs.push (fs);
+            for (; ; scount++) {
+                if (s_props.index)
+                    s_a.off = infile.tellg();
+                if (! s_a.fs.fill(infile, len_check))
+                    break;
+                q_fs.push (s_a);
+            }
         } catch (runtime_error &e) {
             cerr<< "problem reading sequences\n"<< e.what()<<"\n";
             *ret = EXIT_FAILURE;
@@ -123,6 +237,114 @@ clean_and_stop:
     t1.join();
 }
 
+/* ---------------- put_str ----------------------------------
+ * Strings and column runs for checkpoints, with their lengths
+ * in front.
+ */
+static void
+put_str (ostream &out, const string &s)
+{
+    const uint32_t len = uint32_t (s.size());
+    out.write ((const char *) &len, sizeof (len));
+    out.write (s.data(), len);
+}
+
+/* ---------------- get_str ---------------------------------- */
+static bool
+get_str (istream &in, string &s)
+{
+    uint32_t len = 0;
+    in.read ((char *) &len, sizeof (len));
+    if (!in || len > MAX_CKPT_STR)
+        return false;
+    s.resize (len);
+    in.read (&s[0], len);
+    return bool (in);
+}
+
+/* ---------------- put_runs --------------------------------- */
+static void
+put_runs (ostream &out, const vector<uint32_t> &run)
+{
+    const uint32_t n = uint32_t (run.size());
+    out.write ((const char *) &n, sizeof (n));
+    out.write ((const char *) run.data(), streamsize (n * sizeof (run[0])));
+}
+
+/* ---------------- get_runs --------------------------------- */
+static bool
+get_runs (istream &in, vector<uint32_t> &run, const size_t len)
+{
+    uint32_t n = 0;
+    in.read ((char *) &n, sizeof (n));
+    if (!in || n > len + 1)
+        return false;
+    run.resize (n);
+    in.read ((char *) run.data(), streamsize (n * sizeof (run[0])));
+    return bool (in);
+}
+
+/* ---------------- save_props -------------------------------
+ * Write what get_seq_list() found, for a checkpoint. fseq_prop
+ * is only numbers, so it goes as it is in memory, and the size
+ * is written, so a different build does not read it wrongly.
+ */
+static int
+save_props (ostream &out, const seq_props &s_props)
+{
+    static_assert (is_trivially_copyable<fseq_prop>::value, "fseq_prop has to be plain data");
+    const uint64_t head[5] = {sizeof (fseq_prop), s_props.len, s_props.n_rec,
+                              s_props.f_map.size(), s_props.rec.size()};
+    out.write ((const char *) head, sizeof (head));
+    for (map<string, fseq_prop>::const_iterator it = s_props.f_map.begin(); it != s_props.f_map.end(); it++) {
+        put_str (out, it->first);
+        out.write ((const char *) &it->second, sizeof (it->second));
+    }
+    for (const pair<const string, msa_rec> &r : s_props.rec) {
+        const int64_t off = r.second.off;
+        put_str (out, r.first);
+        out.write ((const char *) &off, sizeof (off));
+        put_runs (out, r.second.run);
+        put_runs (out, r.second.dup_run);
+    }
+    if (!out)
+        return (bust (__func__, "error writing sequence properties", 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- load_props -------------------------------
+ * Read what save_props() wrote.
+ */
+static int
+load_props (istream &in, seq_props &s_props)
+{
+    uint64_t head[5];
+    in.read ((char *) head, sizeof (head));
+    if (!in || head[0] != sizeof (fseq_prop))
+        return EXIT_FAILURE;
+    s_props.len = head[1];
+    s_props.n_rec = head[2];
+    string name;
+    for (uint64_t k = 0; k < head[3]; k++) {
+        fseq_prop f_p;
+        if (! get_str (in, name))
+            return EXIT_FAILURE;
+        in.read ((char *) &f_p, sizeof (f_p));
+        s_props.f_map.emplace_hint (s_props.f_map.end(), name, f_p);
+    }
+    for (uint64_t k = 0; k < head[4]; k++) {
+        int64_t off = 0;
+        if (! get_str (in, name))
+            return EXIT_FAILURE;
+        in.read ((char *) &off, sizeof (off));
+        msa_rec &m_r = s_props.rec [name];
+        m_r.off = off;
+        if (! get_runs (in, m_r.run, s_props.len) || ! get_runs (in, m_r.dup_run, s_props.len))
+            return EXIT_FAILURE;
+    }
+    return (in ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
 /* ---------------- get_sacred -------------------------------
  * read the file of sacred sequences.
  * Could be called as a thread, so no exceptions allowed and
@@ -149,7 +371,7 @@ get_sacred (const char *sacred_fname, vector<string> &v_sacred, int *sacred_ret)
  * exist in the alignment file, as store in f_map.
  */
 static int
-check_lists ( const map<string, fseq_prop> &f_map, vector<string> &v_cmt)
+check_lists ( const map<string, fseq_prop> &f_map, const vector<string> &v_cmt)
 {
     unsigned n = 1;
     const char *s1 = "\" in distmat file not found\nIt was sequence number ";
@@ -176,28 +398,59 @@ mark_sacred (map<string, fseq_prop> &f_map, vector<string> &v_sacred)
     return ret;
 }
 
+/* ---------------- seq_state --------------------------------
+ * The removal loop looks at every edge, so it should not look
+ * up names. Each different name in the distance matrix gets a
+ * dense id once and everything the loop needs is in arrays,
+ * indexed by id.
+ * n_alive counts everything still in f_map, including sequences
+ * which are not in the distance matrix, since that is what we
+ * compare with the number to keep.
+ * If record is set, each removal is noted in v_gone.
+ * ndx_of is the other way round, the first dist_mat index with
+ * each id's name.
+ * dist_sum is the sum of distances from each id to the others
+ * still alive. It is only filled in for the central choice.
+ */
+struct seq_state {
+    vector<unsigned> id_of;          /* dist_mat index to id */
+    vector<unsigned> ndx_of;         /* by id */
+    vector<fseq_prop> v_prop;        /* by id */
+    vector<double> dist_sum;         /* by id, only for central choice */
+    vector<const string *> v_name;   /* by id */
+    vector<unsigned char> alive;     /* by id */
+    size_t n_alive;
+    bool record;
+    vector<pair<unsigned, float>> v_gone;
+    vector<float> row;               /* scratch for drop_from_sums() */
+    seq_state () : n_alive (0), record (false) {}
+};
+
 /* ---------------- decider functions ------------------------
  * We have several possibilities for deciding which member of a
  * pair to delete. We use one of these, as pointed to by a
  * function pointer.
  */
-typedef unsigned char decider_f (const fseq_prop&, const fseq_prop&, default_random_engine&);
+typedef unsigned char decider_f (const seq_state&, const unsigned, const unsigned, default_random_engine&);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 static unsigned char
-always_first (const fseq_prop &f1, const fseq_prop &f2, default_random_engine &r_engine)
+always_first (const seq_state &st, const unsigned a, const unsigned b,
+              default_random_engine &r_engine)
 {
     return S_1;
 }
 
 static unsigned char
-always_second (const fseq_prop &f1, const fseq_prop &f2, default_random_engine &r_engine)
+always_second (const seq_state &st, const unsigned a, const unsigned b,
+               default_random_engine &r_engine)
 {
     return S_2;
 }
 
 static unsigned char
-decide_random(const fseq_prop &f1, const fseq_prop &f2, default_random_engine &r_engine)
+decide_random(const seq_state &st, const unsigned a, const unsigned b,
+              default_random_engine &r_engine)
 {
     uniform_int_distribution<int> d{0,1};
     int r = d(r_engine);
@@ -207,9 +460,35 @@ decide_random(const fseq_prop &f1, const fseq_prop &f2, default_random_engine &r
 }
 
 static unsigned char
-decide_longer(const fseq_prop &f1, const fseq_prop &f2, default_random_engine &r_engine)
+decide_longer(const seq_state &st, const unsigned a, const unsigned b,
+              default_random_engine &r_engine)
+{
+    if (st.v_prop[a].ngap < st.v_prop[b].ngap)
+        return S_2;
+    return S_1;
+}
+
+/* Remove the one with more unknown or ambiguous residues, for its
+ * length. If they are the same, go by gaps. */
+static unsigned char
+decide_known(const seq_state &st, const unsigned a, const unsigned b,
+             default_random_engine &r_engine)
+{
+    const float u1 = st.v_prop[a].frac_unknown(), u2 = st.v_prop[b].frac_unknown();
+    if (u1 < u2)
+        return S_2;
+    if (u1 > u2)
+        return S_1;
+    return (decide_longer (st, a, b, r_engine));
+}
+
+/* Both are alive, so their sums are over the same number of
+ * others and comparing sums is comparing mean distances. */
+static unsigned char
+decide_central(const seq_state &st, const unsigned a, const unsigned b,
+               default_random_engine &r_engine)
 {
-    if (f1.ngap < f2.ngap)
+    if (st.dist_sum[a] < st.dist_sum[b])
         return S_2;
     return S_1;
 }
@@ -222,6 +501,8 @@ set_up_choice (const string &s)
     choice_map["second"] = always_second; /* function pointers */
     choice_map["random"] = decide_random;
     choice_map["longer"] = decide_longer;
+    choice_map["central"] = decide_central;
+    choice_map["known"]   = decide_known;
     const map<const string, decider_f *>::const_iterator missing = choice_map.end();
     const map<const string, decider_f *>::const_iterator ent = choice_map.find(s);
 
@@ -238,184 +519,1348 @@ set_up_choice (const string &s)
 }
 
 /* ---------------- choose_seq   -----------------------------
- * Given two seq props, choose one for deletion. Return 1 or 2
+ * Given two ids, choose one for deletion. Return 1 or 2
  * or 0 for nobody.
  * We will have to expand this to consider different options.
  */
 static unsigned char
-choose_seq (const fseq_prop &f1, const fseq_prop &f2, decider_f *choice, default_random_engine &r_engine)
+choose_seq (const seq_state &st, const unsigned a, const unsigned b, decider_f *choice,
+            default_random_engine &r_engine)
 {
+    const fseq_prop &f1 = st.v_prop[a], &f2 = st.v_prop[b];
     if (f1.is_sacred() && f2.is_sacred())
         return NOBODY;
     if (f1.is_sacred())
         return S_2;
     else if(f2.is_sacred())
         return S_1;
-    return (choice (f1, f2, r_engine));
+    return (choice (st, a, b, r_engine));
+}
+
+/* ---------------- set_up_state -----------------------------
+ * Names which are not in f_map (seeds which have been removed)
+ * start off dead.
+ */
+static void
+set_up_state (const map<string, fseq_prop> &f_map, const dist_mat &d_m, seq_state &st)
+{
+    const vector<string> &v_cmt = d_m.get_cmt_vec();
+    unordered_map<string, unsigned> id_map;
+    id_map.reserve (v_cmt.size());
+    st.id_of.resize (v_cmt.size());
+    for (size_t i = 0; i < v_cmt.size(); i++) {
+        const pair<unordered_map<string, unsigned>::iterator, bool> r
+            = id_map.insert (make_pair (v_cmt[i], unsigned (st.v_name.size())));
+        st.id_of[i] = r.first->second;
+        if (! r.second)
+            continue;
+        const map<string, fseq_prop>::const_iterator f = f_map.find (v_cmt[i]);
+        st.v_name.push_back (&v_cmt[i]);
+        st.ndx_of.push_back (unsigned (i));
+        st.v_prop.push_back (f == f_map.end() ? fseq_prop() : f->second);
+        st.alive.push_back (f != f_map.end());
+    }
+    st.n_alive = f_map.size();
+}
+
+/* ---------------- drop_from_sums ---------------------------
+ * Sequence gone is no longer there, so take its distance away
+ * from the sum of everybody still alive.
+ */
+static void
+drop_from_sums (seq_state &st, const dist_mat &d_m, const unsigned gone)
+{
+    vector<float> &row = st.row;
+    d_m.get_row (st.ndx_of[gone], row);
+    for (size_t k = 0; k < st.alive.size(); k++)
+        if (st.alive[k])
+            st.dist_sum[k] -= row [st.ndx_of[k]];
+}
+
+/* ---------------- set_up_sums ------------------------------
+ * For choosing the most central sequences, each one needs the
+ * sum of its distances to the others that are alive. Start from
+ * the sums over whole rows and take away whoever is dead already.
+ */
+static void
+set_up_sums (seq_state &st, const dist_mat &d_m)
+{
+    const vector<double> &sum = d_m.row_sums();
+    st.dist_sum.resize (st.v_prop.size());
+    for (size_t k = 0; k < st.dist_sum.size(); k++)
+        st.dist_sum[k] = sum [st.ndx_of[k]];
+    for (size_t k = 0; k < st.alive.size(); k++)
+        if (! st.alive[k])
+            drop_from_sums (st, d_m, unsigned (k));
+}
+
+/* ---------------- remove_ids -------------------------------
+ * The loop itself, with the decider as a template argument, so
+ * it can be inlined. Only the central choice needs the sums of
+ * distances kept up to date.
+ */
+template <decider_f *choice>
+static void
+remove_ids (seq_state &st, dist_mat &d_m, const unsigned long to_keep,
+            const float cutoff, default_random_engine &r_engine, const size_t start)
+{
+    const dist_mat::edge_iter d_end = d_m.end();
+    dist_mat::edge_iter it = start ? d_m.begin_at (start) : d_m.begin();
+    const unsigned *id_of = st.id_of.data();
+    unsigned char *alive = st.alive.data();
+    for ( ; st.n_alive > to_keep  && (it != d_end); ++it) {
+        if (cutoff >= 0 && !(it.dist() < cutoff))
+            break;
+        const unsigned a = id_of [it.ndx1()];
+        const unsigned b = id_of [it.ndx2()];
+        if (! (alive[a] && alive[b]))  /* sequence already removed */
+            continue;
+        unsigned gone;
+        switch (choose_seq (st, a, b, choice, r_engine)) {
+        case S_1:
+            gone = a;                                                  break;
+        case S_2:
+            gone = b;                                                  break;
+        default:
+            continue;
+        }
+        distplot (st.n_alive, it.dist()); alive[gone] = 0;
+        if (st.record)
+            st.v_gone.push_back (make_pair (gone, it.dist()));
+        if (choice == decide_central)
+            drop_from_sums (st, d_m, gone);
+        st.n_alive--;
+    }
 }
 
 /* ---------------- remove_seq -------------------------------
- * Walk down the list of distances (v_dist), deciding who to delete.
- * We get the indices of the two sequence in ndx1 and ndx2. We look for these
- * in f_map.
+ * Walk down the list of distances in d_m, deciding who to delete.
+ * The distances are only sorted as far as we walk, so
+ * stopping early saves the rest of the sort.
+ * If cutoff is not negative, we also stop at the first distance
+ * that is not below it.
+ * At the end, the sequences that were removed go from f_map.
+ * If we have a trajectory, every step is added to it instead and
+ * f_map is left alone. The caller can then pick out the survivors
+ * for any number to keep which is not smaller than to_keep.
+ * If we are adding to an earlier run, prefix has its removals
+ * which the new sequences cannot change. They go first and the
+ * walk starts at entry start. This only works with a trajectory.
+ * The prefix comes from a file, so a name which is not alive is
+ * an error, not a bug.
+ * Distances in scratch files can fail to be read in the middle
+ * of the walk.
+ */
+static int
+remove_seq (map<string, fseq_prop> &f_map, dist_mat &d_m,
+            const unsigned long to_keep, const float cutoff,
+            decider_f *choice, default_random_engine &r_engine, trajectory *traj,
+            const size_t start = 0, const vector<traj_step> *prefix = nullptr)
+{
+    seq_state st;
+    set_up_state (f_map, d_m, st);
+    st.record = (traj != nullptr);
+    if (prefix) {
+        if (! traj)
+            prog_bug (__FILE__, __LINE__, "prefix without trajectory");
+        unordered_map<string, unsigned> id_map;
+        for (unsigned k = 0; k < st.v_name.size(); k++)
+            id_map [*st.v_name[k]] = k;
+        for (const traj_step &t : *prefix) {
+            const unordered_map<string, unsigned>::const_iterator f = id_map.find (t.name);
+            if (f == id_map.end())
+                return (bust (__func__, t.name.c_str(), "was removed before, but has no distances", 0));
+            if (! st.alive [f->second])
+                return (bust (__func__, t.name.c_str(), "was removed before, more than once", 0));
+            st.alive [f->second] = 0;
+            st.v_gone.push_back (make_pair (f->second, t.dist));
+            st.n_alive--;
+        }
+    }
+    if (choice == decide_central)
+        set_up_sums (st, d_m);
+    try {
+        if (choice == always_first)
+            remove_ids<always_first> (st, d_m, to_keep, cutoff, r_engine, start);
+        else if (choice == always_second)
+            remove_ids<always_second> (st, d_m, to_keep, cutoff, r_engine, start);
+        else if (choice == decide_random)
+            remove_ids<decide_random> (st, d_m, to_keep, cutoff, r_engine, start);
+        else if (choice == decide_longer)
+            remove_ids<decide_longer> (st, d_m, to_keep, cutoff, r_engine, start);
+        else if (choice == decide_central)
+            remove_ids<decide_central> (st, d_m, to_keep, cutoff, r_engine, start);
+        else if (choice == decide_known)
+            remove_ids<decide_known> (st, d_m, to_keep, cutoff, r_engine, start);
+        else
+            prog_bug (__FILE__, __LINE__, "unknown decider");
+    } catch (runtime_error &e) {
+        return (bust (__func__, e.what(), 0));
+    }
+    if (traj) {
+        for (const pair<unsigned, float> &g : st.v_gone)
+            traj->v_step.push_back ({*st.v_name [g.first], g.second});
+        return EXIT_SUCCESS;
+    }
+    for (size_t k = 0; k < st.alive.size(); k++)
+        if (! st.alive[k])
+            f_map.erase (*st.v_name[k]);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- link_sets --------------------------------
+ * Disjoint sets of ids for single linkage clustering, as a
+ * forest with path halving and union by rank. rep has the
+ * representative of each set, at its root. Ids which were not
+ * alive at the start (seeds) are not in play and link nothing.
+ */
+struct link_sets {
+    vector<unsigned> up;
+    vector<unsigned char> rank;
+    vector<unsigned> rep;
+    vector<unsigned char> play;
+    explicit link_sets (const vector<unsigned char> &alive)
+        : up (alive.size()), rank (alive.size(), 0), rep (alive.size()), play (alive) {
+        for (unsigned i = 0; i < up.size(); i++)
+            up[i] = rep[i] = i;
+    }
+    unsigned find (unsigned i) {
+        while (up[i] != i) {
+            up[i] = up [up[i]];
+            i = up[i];
+        }
+        return i;
+    }
+    unsigned join (unsigned a, unsigned b) {   /* a and b are roots */
+        if (rank[a] < rank[b])
+            swap (a, b);
+        up[b] = a;
+        if (rank[a] == rank[b])
+            rank[a]++;
+        return a;
+    }
+};
+
+/* ---------------- link_ids ---------------------------------
+ * Kruskal style single linkage. Walk down the sorted distances
+ * and join the clusters at each end. The representative of the
+ * new cluster is chosen from the two old ones, like a pair in
+ * remove_ids(), and the other is removed. If both are sacred,
+ * both stay, but the clusters are joined anyway. So, as in
+ * remove_ids(), n_alive is the number of sequences we would
+ * write and we stop at to_keep or the cutoff.
+ */
+template <decider_f *choice>
+static void
+link_ids (seq_state &st, link_sets &ls, dist_mat &d_m, const unsigned long to_keep,
+          const float cutoff, default_random_engine &r_engine)
+{
+    const dist_mat::edge_iter d_end = d_m.end();
+    dist_mat::edge_iter it = d_m.begin();
+    const unsigned *id_of = st.id_of.data();
+    for ( ; st.n_alive > to_keep  && (it != d_end); ++it) {
+        if (cutoff >= 0 && !(it.dist() < cutoff))
+            break;
+        const unsigned i = id_of [it.ndx1()], j = id_of [it.ndx2()];
+        if (! (ls.play[i] && ls.play[j]))
+            continue;
+        const unsigned ri = ls.find (i), rj = ls.find (j);
+        if (ri == rj)
+            continue;
+        const unsigned a = ls.rep[ri], b = ls.rep[rj];
+        const unsigned char c = choose_seq (st, a, b, choice, r_engine);
+        const unsigned root = ls.join (ri, rj);
+        ls.rep[root] = (c == S_1) ? b : a;
+        if (c == NOBODY)
+            continue;
+        const unsigned gone = (c == S_1) ? a : b;
+        distplot (st.n_alive, it.dist()); st.alive[gone] = 0;
+        if (st.record)
+            st.v_gone.push_back (make_pair (gone, it.dist()));
+        st.n_alive--;
+    }
+}
+
+/* ---------------- medoid_task ------------------------------
+ * Sums for rows first to last - 1 of cluster clust.
+ */
+struct medoid_task {
+    unsigned clust;
+    unsigned first;
+    unsigned last;
+};
+
+/* ---------------- medoid_worker ----------------------------
+ * Each thread takes the next task from the list until there
+ * are none left. v_mem has the dist_mat index of each member
+ * of each cluster and v_sum gets the sum of distances from
+ * each member to the others.
+ */
+static void
+medoid_worker (const dist_mat *d_m, const vector<vector<unsigned>> *v_mem,
+               const vector<medoid_task> *v_task, atomic<size_t> *next,
+               vector<vector<double>> *v_sum)
+{
+    for (size_t t = (*next)++; t < v_task->size(); t = (*next)++) {
+        const medoid_task &k = (*v_task)[t];
+        const vector<unsigned> &mem = (*v_mem)[k.clust];
+        vector<double> &sum = (*v_sum)[k.clust];
+        for (unsigned i = k.first; i < k.last; i++)
+            sum[i] = d_m->sum_to (mem[i], mem);
+    }
+}
+
+/* ---------------- find_medoids -----------------------------
+ * Make the medoid of each cluster, the member with the smallest
+ * sum of distances to the others, its representative, unless
+ * the representative is sacred. Ties go to the member first in
+ * the distance matrix.
+ * The work for a cluster grows with the square of its size, so
+ * the biggest go first. Big clusters are cut into tasks of a few
+ * rows, so the threads finish together, even if one cluster is
+ * most of the work.
+ */
+static void
+find_medoids (seq_state &st, link_sets &ls, const dist_mat &d_m)
+{
+    vector<vector<unsigned>> v_mem;   /* dist_mat indices */
+    vector<vector<unsigned>> v_id;    /* the same members, as ids */
+    vector<unsigned> clust_of (ls.up.size(), unsigned (-1));
+    for (unsigned i = 0; i < ls.up.size(); i++) {
+        if (! ls.play[i])
+            continue;
+        const unsigned r = ls.find (i);
+        if (st.v_prop [ls.rep[r]].is_sacred())
+            continue;
+        if (clust_of[r] == unsigned (-1)) {
+            clust_of[r] = unsigned (v_mem.size());
+            v_mem.emplace_back();
+            v_id.emplace_back();
+        }
+        v_mem [clust_of[r]].push_back (st.ndx_of[i]);
+        v_id [clust_of[r]].push_back (i);
+    }
+    vector<unsigned> order (v_mem.size());
+    for (unsigned c = 0; c < order.size(); c++)
+        order[c] = c;
+    stable_sort (order.begin(), order.end(), [&v_mem] (const unsigned a, const unsigned b) {
+            return v_mem[a].size() > v_mem[b].size();});
+    vector<medoid_task> v_task;
+    vector<vector<double>> v_sum (v_mem.size());
+    for (const unsigned c : order) {
+        const size_t m = v_mem[c].size();
+        if (m < 3)                    /* sums are all the same */
+            break;
+        v_sum[c].resize (m);
+        const size_t step = max (size_t (1), MEDOID_TASK / m);
+        for (size_t first = 0; first < m; first += step)
+            v_task.push_back ({c, unsigned (first), unsigned (min (m, first + step))});
+    }
+    unsigned n_thr = thread::hardware_concurrency();
+    if (n_thr == 0)
+        n_thr = 1;
+    if (n_thr > v_task.size())
+        n_thr = unsigned (v_task.size());
+    atomic<size_t> next (0);
+    vector<thread> v_thr;
+    for (unsigned t = 0; t < n_thr; t++)
+        v_thr.push_back (thread (medoid_worker, &d_m, &v_mem, &v_task, &next, &v_sum));
+    for (thread &t : v_thr)
+        t.join();
+    for (unsigned c = 0; c < v_mem.size(); c++) {
+        if (v_sum[c].empty())
+            continue;
+        const vector<double> &sum = v_sum[c];
+        const size_t best = size_t (min_element (sum.begin(), sum.end()) - sum.begin());
+        const unsigned r = ls.find (v_id[c][0]);
+        st.alive [ls.rep[r]] = 0;
+        ls.rep[r] = v_id[c][best];
+        st.alive [ls.rep[r]] = 1;
+    }
+}
+
+/* ---------------- write_clusters ---------------------------
+ * One line for each sequence, with the number of its cluster
+ * and its name. Clusters go from the biggest to the smallest and
+ * each starts with its representative. Sequences which are not in
+ * the distance matrix are clusters of their own.
+ */
+static int
+write_clusters (const char *fname, link_sets &ls, const seq_state &st,
+                const map<string, fseq_prop> &f_map)
+{
+    vector<vector<const string *>> v_clust;
+    vector<unsigned> clust_of (ls.up.size(), unsigned (-1));
+    unordered_set<string> in_dist;
+    for (unsigned i = 0; i < ls.up.size(); i++) {
+        in_dist.insert (*st.v_name[i]);
+        if (! ls.play[i])
+            continue;
+        const unsigned r = ls.find (i);
+        if (clust_of[r] == unsigned (-1)) {
+            clust_of[r] = unsigned (v_clust.size());
+            v_clust.push_back (vector<const string *> (1, st.v_name [ls.rep[r]]));
+        }
+        if (i != ls.rep[r])
+            v_clust [clust_of[r]].push_back (st.v_name[i]);
+    }
+    for (const pair<const string, fseq_prop> &f : f_map)
+        if (! in_dist.count (f.first))
+            v_clust.push_back (vector<const string *> (1, &f.first));
+    stable_sort (v_clust.begin(), v_clust.end(),
+                 [] (const vector<const string *> &a, const vector<const string *> &b) {
+                     return a.size() > b.size();});
+    ofstream outfile (fname);
+    if (!outfile)
+        return (bust (__func__, "Open fail for writing on", fname, ": ", strerror(errno), 0));
+    outfile << "# " << v_clust.size() << " clusters. cluster number, name."
+            << " The representative comes first.\n";
+    for (size_t c = 0; c < v_clust.size(); c++)
+        for (const string *name : v_clust[c])
+            outfile << c + 1 << '\t' << *name << '\n';
+    outfile.close();
+    if (outfile.fail())
+        return (bust (__func__, "Error writing to", fname, 0));
+    cout << "Wrote " << v_clust.size() << " clusters to " << fname << '\n';
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- cluster_seq ------------------------------
+ * Like remove_seq(), but by single linkage. The sequences which
+ * are not representatives go from f_map, or into the trajectory,
+ * and the clusters are written to clust_fname.
+ * With central choice, the representatives are medoids, picked
+ * after the clusters are built. They are not nested like the
+ * survivors of a walk, so there can be no trajectory.
+ */
+static int
+cluster_seq (map<string, fseq_prop> &f_map, dist_mat &d_m,
+             const unsigned long to_keep, const float cutoff, decider_f *choice,
+             default_random_engine &r_engine, trajectory *traj, const char *clust_fname)
+{
+    seq_state st;
+    set_up_state (f_map, d_m, st);
+    st.record = (traj != nullptr);
+    link_sets ls (st.alive);
+    try {
+        if (choice == always_first)
+            link_ids<always_first> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else if (choice == always_second)
+            link_ids<always_second> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else if (choice == decide_random)
+            link_ids<decide_random> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else if (choice == decide_longer)
+            link_ids<decide_longer> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else if (choice == decide_known)
+            link_ids<decide_known> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else if (choice == decide_central && ! traj)
+            link_ids<always_first> (st, ls, d_m, to_keep, cutoff, r_engine);
+        else
+            prog_bug (__FILE__, __LINE__, "decider not for clustering");
+    } catch (runtime_error &e) {
+        return (bust (__func__, e.what(), 0));
+    }
+    if (choice == decide_central)
+        find_medoids (st, ls, d_m);
+    if (write_clusters (clust_fname, ls, st, f_map) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if (traj) {
+        for (const pair<unsigned, float> &g : st.v_gone)
+            traj->v_step.push_back ({*st.v_name [g.first], g.second});
+        return EXIT_SUCCESS;
+    }
+    for (size_t k = 0; k < st.alive.size(); k++)
+        if (! st.alive[k])
+            f_map.erase (*st.v_name[k]);
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- ens_run ----------------------------------
+ * One run of an ensemble. Each has its own random numbers and a
+ * bit for each id in the distance matrix, set while alive.
+ */
+struct ens_run {
+    unsigned long seed;
+    vector<uint64_t> alive;
+    size_t n_alive;
+};
+
+/* ---------------- ens_remove -------------------------------
+ * Like remove_ids(), but the distances are shared with other
+ * threads, so they are read with edge_at() and nothing in st or
+ * d_m is touched. Random choice is the only one that makes sense.
  */
 static void
-remove_seq (map<string, fseq_prop> &f_map, vector<string> &v_cmt,
-            vector<dist_entry> &v_dist, const unsigned long to_keep,
-            decider_f *choice, default_random_engine &r_engine)
-{
-    vector<dist_entry>::const_iterator it = v_dist.begin();
-    for ( ; f_map.size() > to_keep  && (it != v_dist.end()); it++) {
-        const string &s1 = v_cmt[it->ndx1];
-        const string &s2 = v_cmt[it->ndx2];
-        const map<string, fseq_prop>::const_iterator missing = f_map.end();
-        const map<string, fseq_prop>::const_iterator f1      = f_map.find(s1);
-        const map<string, fseq_prop>::const_iterator f2      = f_map.find(s2);
-        if ((f1 == missing) || (f2 == missing)) /* sequence already removed */
-            continue;                         /* from the list of sequences */
-        switch (choose_seq(f1->second, f2->second, choice, r_engine)) {
-        case NOBODY:
-            continue;        /* break; otherwise compiler complains */
+ens_remove (const seq_state &st, const dist_mat &d_m, const unsigned long to_keep,
+            const float cutoff, ens_run &run)
+{
+    default_random_engine r_engine (run.seed);
+    run.alive.assign ((st.alive.size() + 63) / 64, 0);
+    uint64_t *alive = run.alive.data();
+    for (size_t k = 0; k < st.alive.size(); k++)
+        if (st.alive[k])
+            alive[k / 64] |= uint64_t (1) << (k % 64);
+    run.n_alive = st.n_alive;
+    const unsigned *id_of = st.id_of.data();
+    const size_t n_edge = d_m.n_edge();
+    for (size_t i = 0; run.n_alive > to_keep && i < n_edge; i++) {
+        const dist_entry e = d_m.edge_at (i);
+        if (cutoff >= 0 && !(e.dist < cutoff))
+            break;
+        const unsigned a = id_of [e.ndx1];
+        const unsigned b = id_of [e.ndx2];
+        if (! ((alive[a / 64] >> (a % 64)) & (alive[b / 64] >> (b % 64)) & 1))
+            continue;
+        unsigned gone;
+        switch (choose_seq (st, a, b, decide_random, r_engine)) {
         case S_1:
-            distplot (f_map.size(), it->dist); f_map.erase (s1); break;
+            gone = a;                                                  break;
         case S_2:
-            distplot (f_map.size(), it->dist); f_map.erase(s2);  break;
+            gone = b;                                                  break;
+        default:
+            continue;
         }
+        alive[gone / 64] &= ~(uint64_t (1) << (gone % 64));
+        run.n_alive--;
     }
 }
 
+/* ---------------- ens_worker -------------------------------
+ * Take runs off the list until there are none left.
+ */
+static void
+ens_worker (const seq_state *st, const dist_mat *d_m, const unsigned long to_keep,
+            const float cutoff, vector<ens_run> *v_run, atomic<size_t> *next)
+{
+    for (size_t r = (*next)++; r < v_run->size(); r = (*next)++)
+        ens_remove (*st, *d_m, to_keep, cutoff, (*v_run)[r]);
+}
+
 /* ---------------- remove_seeds -----------------------------
+ * If there is a trajectory, note what went.
  */
 static void
-remove_seeds (map<string, fseq_prop> &f_map, vector<string> &v_cmt)
+remove_seeds (map<string, fseq_prop> &f_map, const vector<string> &v_cmt, trajectory *traj)
 {
     vector<string>::const_iterator it = v_cmt.begin();
     for (; it != v_cmt.end(); it++)
         if (it->find (SEED_STR) != string::npos)
-            f_map.erase (*it);
+            if (f_map.erase (*it) && traj)
+                traj->v_step.push_back ({*it, 0.0});
+    if (traj)
+        traj->n_seed = traj->v_step.size();
 }
 
-/* ---------------- squash  ----------------------------------
- * Given a string, keep only the positions which are set
- * true in the vector.
+/* ---------------- kept_sets --------------------------------
+ * We may write several output files from one reduction. The
+ * survivors are nested. A sequence goes into output i if it is in
+ * f_map and was not among the first k_end steps of the trajectory
+ * (if there is one). step_of says where each removed sequence is
+ * in the trajectory.
+ * Runs of an ensemble are not nested. Each output has a bit for
+ * every id that is still alive and id_of gives the id of a name.
+ */
+struct out_set {
+    string fname;
+    size_t k_end;
+    const vector<uint64_t> *alive;   /* for ensembles, otherwise nullptr */
+    vector<uint64_t> v_used;         /* columns used, if filtering, 64 to a word */
+    vector<uint32_t> keep_run;       /* v_used as runs of unused and used columns */
+    vector<uint32_t> n_res;          /* residues in each column, if trimming */
+    size_t n_seq;                    /* sequences in this output, if trimming */
+    out_set () : k_end (0), alive (nullptr), n_seq (0) {}
+};
+
+/* ---------------- trim_opt ---------------------------------
+ * When filtering columns, drop those where more than max_gap of
+ * the kept sequences have a gap, not just those which are all
+ * gaps. If map_fname is set, say which input column each output
+ * column came from.
+ */
+struct trim_opt {
+    float max_gap;
+    const char *map_fname;
+    trim_opt () : max_gap (1.0), map_fname (nullptr) {}
+};
+
+struct kept_sets {
+    const map<string, fseq_prop> *f_map;
+    unordered_map<string, size_t> step_of;
+    unordered_map<string, unsigned> id_of;
+    vector<out_set> v_set;
+};
+
+/* ---------------- set_up_sets ------------------------------
+ */
+static void
+set_up_sets (kept_sets &ks, const map<string, fseq_prop> &f_map, const trajectory *traj,
+             const vector<string> &v_fname, const vector<size_t> &v_k_end)
+{
+    ks.f_map = &f_map;
+    ks.step_of.clear();
+    if (traj)
+        for (size_t k = 0; k < traj->v_step.size(); k++)
+            ks.step_of [traj->v_step[k].name] = k;
+    ks.v_set.resize (v_fname.size());
+    for (size_t i = 0; i < v_fname.size(); i++) {
+        ks.v_set[i].fname = v_fname[i];
+        ks.v_set[i].k_end = v_k_end[i];
+    }
+}
+
+/* ---------------- member_of --------------------------------
+ * Which outputs does this sequence go to ? Return true if any.
+ */
+static bool
+member_of (const kept_sets &ks, const string &name, vector<unsigned char> &in)
+{
+    in.assign (ks.v_set.size(), 0);
+    if (ks.f_map->find (name) == ks.f_map->end())
+        return false;
+    size_t step = numeric_limits<size_t>::max();
+    const unordered_map<string, size_t>::const_iterator s_it = ks.step_of.find (name);
+    if (s_it != ks.step_of.end())
+        step = s_it->second;
+    const unordered_map<string, unsigned>::const_iterator i_it = ks.id_of.find (name);
+    bool any = false;
+    for (size_t i = 0; i < ks.v_set.size(); i++) {
+        const out_set &o_s = ks.v_set[i];
+        if (o_s.alive && i_it != ks.id_of.end()) {
+            const unsigned id = i_it->second;
+            if (! (((*o_s.alive)[id / 64] >> (id % 64)) & 1))
+                continue;
+        }
+        if (step >= o_s.k_end) {
+            in[i] = 1;
+            any = true;
+        }
+    }
+    return any;
+}
+
+/* ---------------- write_rec --------------------------------
+ * Write one sequence to each output it belongs in, as flagged
+ * by in.
  */
 static void
-squash (string &s, const vector<bool> &v_used) {
-    string new_s;
-    new_s.reserve(s.size());
-    vector<bool>::const_iterator v_it = v_used.begin();
-    for( std::string::iterator s_it=s.begin(); s_it!=s.end(); ++s_it, ++v_it)
-        if (*v_it)
-            new_s += *s_it;
-    s = new_s;
-    s.shrink_to_fit();
+write_rec (fseq &fs, const vector<unsigned char> &in, const kept_sets &ks,
+           vector<unique_ptr<ofstream>> &v_out, const bool filter_col, const bool r_gaps_flag)
+{
+    if (r_gaps_flag)
+        fs.clean(false, true); /* Remove gaps and white spaces */
+    const string seq = fs.get_seq();
+    for (size_t i = 0; i < ks.v_set.size(); i++) {
+        if (! in[i])
+            continue;
+        ofstream &out_file = *v_out[i];
+        out_file << fs.get_cmmt() << '\n'; /* Write comment verbatim */
+        string s = seq;           /* but the sequence could have long */
+        if (filter_col)           /* lines that should be split into pieces. */
+            squash_runs (s, ks.v_set[i].keep_run); /* Remove columns that were not used */
+        size_t done = 0, to_go = s.length();
+        while (to_go) {
+            size_t this_line = SEQ_LINE_LEN;
+            if (SEQ_LINE_LEN > to_go)
+                this_line = to_go;
+            out_file << s.substr (done, this_line)<< '\n';
+            done += this_line;
+            to_go -= this_line;
+        }
+    }
 }
 
 /* ---------------- write_kept_seq ---------------------------
  * This is the final writing of sequences that we want to keep.
- * filter_col means remove gaps that are present in every sequence.
+ * One pass over the input writes every output file.
+ * filter_col means remove gaps that are present in every sequence
+ * of that output, as found in v_used.
  * r_gaps_flag means remove all gaps.
+ * If we have an index (idx), we do not read through the file,
+ * but jump to each record we want, in the order of the file.
  */
 static int
-write_kept_seq (const char *in_fname, const char *out_fname,
-                map<string, fseq_prop> &f_map, const vector<bool> &v_used,
-                const bool r_gaps_flag)
+write_kept_seq (const char *in_fname, const kept_sets &ks, const seq_props *idx,
+                const bool filter_col, const bool r_gaps_flag)
 {
     ifstream in_file (in_fname);
     const char *o_fail_r = "open fail (reading) on ";
     const char *o_fail_w = "open fail for writing on ";
-    bool filter_col;
-    if (v_used.size() != 0)
-        filter_col = true;
-    else
-        filter_col = false;
 
     fseq fs;
     if (! in_file)
         return(bust(__func__, o_fail_r, in_fname, 0));
 
-    ofstream out_file (out_fname);
-    if ( ! out_file)
-        return (bust(__func__, o_fail_w, out_fname, ": ",  strerror(errno), 0));
+    vector<unique_ptr<ofstream>> v_out;
+    for (const out_set &o_s : ks.v_set) {
+        v_out.push_back (unique_ptr<ofstream> (new ofstream (o_s.fname)));
+        if ( ! *v_out.back())
+            return (bust(__func__, o_fail_w, o_s.fname.c_str(), ": ",  strerror(errno), 0));
+    }
     if (r_gaps_flag && filter_col)
         return (bust (__func__, "programming bug. Both rgaps and filter_col set", 0));
 
-    while (fs.fill (in_file, 0)) {
-        const map<string, fseq_prop>::const_iterator missing = f_map.end();
-        const map<string, fseq_prop>::const_iterator f1 = f_map.find(fs.get_cmmt());
-        if (f1 != missing) {
-            out_file << fs.get_cmmt() << '\n'; /* Write comment verbatim */
-            size_t done = 0, to_go;   /* but the sequence could have long */
-            if (r_gaps_flag)
-                fs.clean(false, true); /* Remove gaps and white spaces */
-            string s = fs.get_seq();  /* lines that should be split into pieces. */
-            if (filter_col)           /* Remove columns that were not used */
-                squash (s, v_used);
-            else if (r_gaps_flag) {
-
-            }
-            to_go = s.length();
-            while (to_go) {
-                size_t this_line = SEQ_LINE_LEN;
-                if (SEQ_LINE_LEN > to_go)
-                    this_line = to_go;
-                out_file << s.substr (done, this_line)<< '\n';
-                done += this_line;
-                to_go -= this_line;
-            }
-            f_map.erase (fs.get_cmmt()); /* stop duplicates being written again */
+    vector<unsigned char> in;
+    if (idx) {
+        vector<pair<streamoff, const string *>> v_want;
+        for (map<string, fseq_prop>::const_iterator it = ks.f_map->begin(); it != ks.f_map->end(); it++)
+            if (member_of (ks, it->first, in))
+                v_want.push_back (make_pair (idx->rec.at (it->first).off, &it->first));
+        sort (v_want.begin(), v_want.end());
+        for (const pair<streamoff, const string *> &w : v_want) {
+            in_file.clear();
+            in_file.seekg (w.first);
+            if (! fs.fill (in_file, 0) || fs.get_cmmt() != *w.second)
+                return (bust (__func__, in_fname, "has changed since it was read. Looking for",
+                              w.second->c_str(), 0));
+            member_of (ks, *w.second, in);
+            write_rec (fs, in, ks, v_out, filter_col, r_gaps_flag);
+        }
+    } else {
+        unordered_set<string> written;   /* stop duplicates being written again */
+        while (fs.fill (in_file, 0)) {
+            if (! member_of (ks, fs.get_cmmt(), in))
+                continue;
+            if (! written.insert (fs.get_cmmt()).second)
+                continue;
+            write_rec (fs, in, ks, v_out, filter_col, r_gaps_flag);
         }
     }
 
     in_file.close();
-    out_file.close();
+    for (size_t i = 0; i < v_out.size(); i++) {
+        v_out[i]->close();
+        if (v_out[i]->fail())
+            return (bust (__func__, "error writing to", ks.v_set[i].fname.c_str(), 0));
+    }
     return (EXIT_SUCCESS);
 }
 
+/* ---------------- count_slice ------------------------------
+ * Add the residues in columns c0 to c1 of each sequence in the
+ * batch to the counts of the outputs it goes to. Each thread has
+ * its own slice of columns, so nobody writes to the same place.
+ */
+static void
+count_slice (const vector<string> *v_seq, const vector<vector<unsigned char>> *v_in,
+             const size_t n_batch, vector<out_set> *v_set, const size_t c0, const size_t c1)
+{
+    for (size_t b = 0; b < n_batch; b++) {
+        const char *p = (*v_seq)[b].data();
+        const size_t end = min (c1, (*v_seq)[b].size());
+        for (size_t i = 0; i < v_set->size(); i++) {
+            if (! (*v_in)[b][i])
+                continue;
+            uint32_t *n_res = (*v_set)[i].n_res.data();
+            for (size_t c = c0; c < end; c++)
+                n_res[c] += (p[c] != GAPCHAR);
+        }
+    }
+}
+
+/* ---------------- count_batch ------------------------------
+ * Count residues in a batch of sequences, splitting the columns
+ * between threads.
+ */
+static void
+count_batch (const vector<string> &v_seq, const vector<vector<unsigned char>> &v_in,
+             const size_t n_batch, vector<out_set> &v_set, const size_t len)
+{
+    unsigned n_thr = thread::hardware_concurrency();
+    if (n_thr == 0)
+        n_thr = 1;
+    const size_t min_slice = 4096;        /* not worth a thread for less */
+    if (n_thr > len / min_slice)
+        n_thr = unsigned (len / min_slice);
+    if (n_thr < 2) {
+        count_slice (&v_seq, &v_in, n_batch, &v_set, 0, len);
+        return;
+    }
+    vector<thread> v_thr;
+    for (unsigned t = 0; t < n_thr; t++)
+        v_thr.push_back (thread (count_slice, &v_seq, &v_in, n_batch, &v_set,
+                                 len * t / n_thr, len * (t + 1) / n_thr));
+    for (thread &t : v_thr)
+        t.join();
+}
+
+/* ---------------- trim_mask --------------------------------
+ * From the counts, set the columns we keep. There must be some
+ * residue and not too many gaps.
+ */
+static void
+trim_mask (out_set &o_s, const float max_gap)
+{
+    fill (o_s.v_used.begin(), o_s.v_used.end(), 0);
+    const double most_gaps = double (max_gap) * double (o_s.n_seq);
+    for (size_t c = 0; c < o_s.n_res.size(); c++) {
+        const uint32_t n = o_s.n_res[c];
+        if (n && double (o_s.n_seq - n) <= most_gaps)
+            o_s.v_used[c / 64] |= uint64_t (1) << (c % 64);
+    }
+}
+
+/* ---------------- write_col_map ----------------------------
+ * For each output, which input column each output column came
+ * from, counting from 1.
+ */
+static int
+write_col_map (const char *fname, const kept_sets &ks, const size_t len)
+{
+    ofstream out_file (fname);
+    if (!out_file)
+        return (bust (__func__, "open fail for writing on", fname, ": ", strerror(errno), 0));
+    for (const out_set &o_s : ks.v_set) {
+        out_file << "# " << o_s.fname << ": " << mask_count (o_s.v_used) << " of "
+                 << len << " columns\n# out in\n";
+        size_t pos = 0, n_out = 0;
+        for (size_t k = 0; k < o_s.keep_run.size(); k++) {
+            if (k % 2)
+                for (size_t c = pos; c < pos + o_s.keep_run[k]; c++)
+                    out_file << ++n_out << ' ' << c + 1 << '\n';
+            pos += o_s.keep_run[k];
+        }
+    }
+    out_file.close();
+    if (out_file.fail())
+        return (bust (__func__, "error writing to", fname, 0));
+    return EXIT_SUCCESS;
+}
+
 /* ---------------- find_used_columns ------------------------
  * We have an alignment, but not all the columns are used.
- * Visit every sequence in the alignment
- * Visit every site in the sequence and mark the corresponding
- * position as true if it is not a gap.
+ * Visit every sequence in the alignment, make a mask of the
+ * sites which are not gaps and OR it into the mask of every
+ * output the sequence goes to.
+ * With an index, the columns of each record are there already,
+ * so the file is not read.
+ * If we trim by the fraction of gaps, we count residues in each
+ * column instead, on threads, and make the masks from the
+ * counts. Each name is counted once.
+ * At the end, turn each mask into runs for squash_runs().
  */
 static int
-find_used_columns (const char *in_fname,
-                   const map<string, fseq_prop> &f_map, vector<bool> &v_used,
-                   const short unsigned verbosity)
+find_used_columns (const char *in_fname, kept_sets &ks, const seq_props &s_props,
+                   const float max_gap, const short unsigned verbosity)
 {
-    unsigned nf_in = 0;
-    ifstream in_file (in_fname);
-    fseq fs;
-    if (! in_file)
-        return (bust(__func__, "open fail reading from ", in_fname, 0));
-
-    const map<string, fseq_prop>::const_iterator missing = f_map.end();
-    while (fs.fill (in_file, 0)) {
-        nf_in++;
-        const map<string, fseq_prop>::const_iterator f = f_map.find(fs.get_cmmt());
-        if (f != missing) {
-            const string s = fs.get_seq(); /* need this temporary, otherwise memory error */
-            string::const_iterator s_it = s.begin();
-            vector<bool>::iterator v_it = v_used.begin();
-            for (unsigned short n = 0 ;s_it != s.end(); s_it++, v_it++, n++)
-                if (*s_it != GAPCHAR)
-                    if (! *v_it)
-                        *v_it = true;
+    size_t nf_in = 0;
+    const size_t n_word = (s_props.len + 63) / 64;
+    const bool count = max_gap < 1.0;
+    for (out_set &o_s : ks.v_set) {
+        o_s.v_used.assign (n_word, 0);
+        if (count)
+            o_s.n_res.assign (s_props.len, 0);
+    }
+    vector<unsigned char> in;
+    if (s_props.index) {
+        nf_in = s_props.n_rec;
+        for (map<string, fseq_prop>::const_iterator it = ks.f_map->begin(); it != ks.f_map->end(); it++) {
+            if (! member_of (ks, it->first, in))
+                continue;
+            const msa_rec &m_r = s_props.rec.at (it->first);
+            for (size_t i = 0; i < ks.v_set.size(); i++) {
+                if (! in[i])
+                    continue;
+                out_set &o_s = ks.v_set[i];
+                if (! count) {
+                    runs_or_mask (m_r.run, o_s.v_used);
+                    runs_or_mask (m_r.dup_run, o_s.v_used);
+                    continue;
+                }
+                o_s.n_seq++;
+                size_t pos = 0;
+                for (size_t k = 0; k < m_r.run.size(); k++) {
+                    if (k % 2)
+                        for (size_t c = pos; c < pos + m_r.run[k] && c < s_props.len; c++)
+                            o_s.n_res[c]++;
+                    pos += m_r.run[k];
+                }
+            }
+        }
+    } else {
+        ifstream in_file (in_fname);
+        fseq fs;
+        if (! in_file)
+            return (bust(__func__, "open fail reading from ", in_fname, 0));
+        vector<uint64_t> mask (n_word);
+        vector<string> v_seq (count ? N_SEQBUF : 0);
+        vector<vector<unsigned char>> v_in (v_seq.size());
+        size_t n_batch = 0;
+        unordered_set<string> seen;
+        while (fs.fill (in_file, 0)) {
+            nf_in++;
+            if (! member_of (ks, fs.get_cmmt(), in))
+                continue;
+            if (count) {
+                if (! seen.insert (fs.get_cmmt()).second)
+                    continue;
+                for (size_t i = 0; i < ks.v_set.size(); i++)
+                    ks.v_set[i].n_seq += in[i];
+                v_seq[n_batch] = fs.get_seq_ref();
+                v_in[n_batch++] = in;
+                if (n_batch == v_seq.size()) {
+                    count_batch (v_seq, v_in, n_batch, ks.v_set, s_props.len);
+                    n_batch = 0;
+                }
+                continue;
+            }
+            fill (mask.begin(), mask.end(), 0);
+            or_nongap (fs.get_seq_ref(), mask);
+            for (size_t i = 0; i < ks.v_set.size(); i++)
+                if (in[i])
+                    or_mask (mask, ks.v_set[i].v_used);
         }
+        if (n_batch)
+            count_batch (v_seq, v_in, n_batch, ks.v_set, s_props.len);
+        in_file.close();
+    }
+    for (out_set &o_s : ks.v_set) {
+        if (count) {
+            trim_mask (o_s, max_gap);
+            o_s.n_res.clear();
+            o_s.n_res.shrink_to_fit();
+        }
+        mask_runs (o_s.v_used, s_props.len, o_s.keep_run);
     }
-    in_file.close();
     if (verbosity > 0) {
-        unsigned n = 0;
-        vector<bool>::iterator v_it = v_used.begin();
-        for (; v_it != v_used.end(); v_it++)
-            if (*v_it)
-                n++;
-        cout << __func__<< ": "<< nf_in << " sequences read. Of " <<
-            v_used.size() << " sites, "<< n<< " will be kept.\n";
+        for (const out_set &o_s : ks.v_set) {
+            const size_t n = mask_count (o_s.v_used);
+            cout << __func__<< ": "<< nf_in << " sequences read. Of " <<
+                s_props.len << " sites, "<< n<< " will be kept";
+            if (ks.v_set.size() > 1)
+                cout << " in " << o_s.fname;
+            cout << ".\n";
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- write_kept_dist --------------------------
+ * Write the distances between the sequences we kept, so the next
+ * round does not have to calculate them again. Call this before
+ * write_kept_seq(), which empties f_map.
+ */
+static int
+write_kept_dist (const dist_mat &d_m, const map<string, fseq_prop> &f_map,
+                 const char *hat2_fname, const char *bin_fname)
+{
+    const vector<string> &v_cmt = d_m.get_cmt_vec();
+    vector<bool> keep (v_cmt.size());
+    for (size_t i = 0; i < v_cmt.size(); i++)
+        keep[i] = (f_map.find (v_cmt[i]) != f_map.end());
+    vector<string> v_sub_cmt;
+    vector<float> v_tri;
+    if (d_m.sub_tri (keep, v_sub_cmt, v_tri) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if (hat2_fname)
+        if (write_hat2 (hat2_fname, v_sub_cmt, v_tri) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    if (bin_fname)
+        if (write_bin (bin_fname, v_sub_cmt, v_tri) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- split_list -------------------------------
+ * "a,b,c" to a vector of strings.
+ */
+static void
+split_list (const char *s, vector<string> &v)
+{
+    v.clear();
+    if (s == nullptr)
+        return;
+    string tok;
+    for (const char *p = s; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            v.push_back (tok);
+            tok.clear();
+            if (*p == '\0')
+                break;
+        } else {
+            tok += *p;
+        }
+    }
+}
+
+/* ---------------- write_output -----------------------------
+ * Write all the output files.
+ */
+static int
+write_output (const char *in_fname, kept_sets &ks, const seq_props &s_props,
+              const bool filter_col, const trim_opt &t_opt, const bool r_gaps_flag,
+              const short unsigned verbosity)
+{
+    if (filter_col) {
+        if (find_used_columns (in_fname, ks, s_props, t_opt.max_gap, verbosity) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if (t_opt.map_fname)
+            if (write_col_map (t_opt.map_fname, ks, s_props.len) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+    }
+    return (write_kept_seq (in_fname, ks, s_props.index ? &s_props : nullptr,
+                            filter_col, r_gaps_flag));
+}
+
+/* ---------------- write_freq -------------------------------
+ * For each sequence, how many runs kept it and what fraction,
+ * most often kept first. Sequences that are not in the distance
+ * matrix are always kept.
+ */
+static int
+write_freq (const char *fname, const map<string, fseq_prop> &f_map, const seq_state &st,
+            const vector<ens_run> &v_run)
+{
+    vector<unsigned> v_count (st.v_name.size(), 0);
+    for (const ens_run &run : v_run)
+        for (size_t k = 0; k < v_count.size(); k++)
+            v_count[k] += (run.alive[k / 64] >> (k % 64)) & 1;
+    unordered_set<string> in_dm;
+    vector<pair<unsigned, const string *>> v_freq;
+    for (size_t k = 0; k < v_count.size(); k++) {
+        in_dm.insert (*st.v_name[k]);
+        if (st.alive[k])
+            v_freq.push_back (make_pair (v_count[k], st.v_name[k]));
+    }
+    for (map<string, fseq_prop>::const_iterator it = f_map.begin(); it != f_map.end(); it++)
+        if (in_dm.find (it->first) == in_dm.end())
+            v_freq.push_back (make_pair (unsigned (v_run.size()), &it->first));
+    stable_sort (v_freq.begin(), v_freq.end(),
+                 [] (const pair<unsigned, const string *> &a, const pair<unsigned, const string *> &b)
+                 { return a.first > b.first;});
+
+    ofstream out_file (fname);
+    if (!out_file)
+        return (bust (__func__, "open fail for writing on", fname, ": ", strerror(errno), 0));
+    out_file << "# " << v_run.size() << " runs, seeds " << v_run.front().seed << " to "
+             << v_run.back().seed << "\n# kept   fraction name\n";
+    for (const pair<unsigned, const string *> &f : v_freq)
+        out_file << setw (6) << f.first << ' ' << setw (10)
+                 << double (f.first) / double (v_run.size()) << ' ' << *f.second << '\n';
+    out_file.close();
+    if (out_file.fail())
+        return (bust (__func__, "error writing to", fname, 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- run_ensemble -----------------------------
+ * n_run independent runs with random choice and seeds seed,
+ * seed+1, ... They all share the sorted distances in d_m, so it
+ * costs about one load of the matrix. Write how often each
+ * sequence was kept to freq_fname and, if stem is set, each
+ * run's alignment to stem.seed, all in one pass over in_fname.
+ */
+static int
+run_ensemble (const seq_props &s_props, dist_mat &d_m, const unsigned long to_keep,
+              const float cutoff, const unsigned n_run, const unsigned long seed,
+              const char *freq_fname, const char *stem, const char *in_fname,
+              const bool filter_col, const trim_opt &t_opt, const bool r_gaps_flag,
+              const short unsigned verbosity)
+{
+    const map<string, fseq_prop> &f_map = s_props.f_map;
+    if (d_m.sort_all() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    seq_state st;
+    set_up_state (f_map, d_m, st);
+    vector<ens_run> v_run (n_run);
+    for (unsigned r = 0; r < n_run; r++)
+        v_run[r].seed = seed + r;
+
+    unsigned n_thr = thread::hardware_concurrency();
+    if (n_thr == 0)
+        n_thr = 1;
+    if (n_thr > n_run)
+        n_thr = n_run;
+    if (verbosity > 0)
+        cout << "Ensemble of " << n_run << " runs on " << n_thr << " threads\n";
+    atomic<size_t> next (0);
+    vector<thread> v_thr;
+    for (unsigned t = 0; t < n_thr; t++)
+        v_thr.push_back (thread (ens_worker, &st, &d_m, to_keep, cutoff, &v_run, &next));
+    for (thread &t : v_thr)
+        t.join();
+
+    if (write_freq (freq_fname, f_map, st, v_run) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    cout << "Wrote how often each sequence was kept to " << freq_fname << '\n';
+    if (! stem)
+        return EXIT_SUCCESS;
+    kept_sets ks;
+    ks.f_map = &f_map;
+    for (size_t k = 0; k < st.v_name.size(); k++)
+        ks.id_of [*st.v_name[k]] = unsigned (k);
+    ks.v_set.resize (n_run);
+    for (unsigned r = 0; r < n_run; r++) {
+        ks.v_set[r].fname = string (stem) + '.' + to_string (v_run[r].seed);
+        ks.v_set[r].alive = &v_run[r].alive;
+        if (verbosity > 0)
+            cout << "Writing " << v_run[r].n_alive << " sequences to " << ks.v_set[r].fname << '\n';
+    }
+    return (write_output (in_fname, ks, s_props, filter_col, t_opt, r_gaps_flag, verbosity));
+}
+
+/* ---------------- get_keep_list ----------------------------
+ * Turn the list of numbers to keep into numbers. No list means
+ * we only have a cutoff, so one output with nothing to keep.
+ * Check we have one output file for each.
+ */
+static int
+get_keep_list (const char *keep_list, const vector<string> &v_out, vector<unsigned long> &v_n)
+{
+    vector<string> v_keep;
+    split_list (keep_list, v_keep);
+    if (v_keep.empty())
+        v_keep.push_back ("0");
+    if (v_keep.size() != v_out.size())
+        return (bust (__func__, "need as many output files as numbers to keep", 0));
+    v_n.clear();
+    for (const string &k : v_keep) {
+        try {
+            v_n.push_back (stoul (k));
+        } catch (const std::exception &e) {
+            return (bust (__func__, "invalid number to keep: \"", k.c_str(), "\"", 0));
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- write_traj_sets --------------------------
+ * We have a trajectory and the sequences. Write the survivors
+ * for each number to keep to the output at the same place in
+ * v_out.
+ */
+static int
+write_traj_sets (const trajectory &traj, const seq_props &s_props, const char *in_fname,
+                 const vector<string> &v_out, const vector<unsigned long> &v_n, const float cutoff,
+                 const bool filter_col, const trim_opt &t_opt, const bool r_gaps_flag,
+                 const short unsigned verbosity)
+{
+    if (s_props.f_map.size() != traj.n0) {
+        const string n_s = to_string (s_props.f_map.size()), n_t = to_string (traj.n0);
+        return (bust (__func__, in_fname, "has", n_s.c_str(), "sequences, but the trajectory started with",
+                      n_t.c_str(), 0));
+    }
+    for (const traj_step &t : traj.v_step)
+        if (s_props.f_map.find (t.name) == s_props.f_map.end())
+            return (bust (__func__, "sequence", t.name.c_str(), "from trajectory not found in", in_fname, 0));
+
+    vector<size_t> v_k_end;
+    for (size_t i = 0; i < v_n.size(); i++) {
+        v_k_end.push_back (traj_n_remove (traj, v_n[i], cutoff));
+        cout << "Writing " << traj.n0 - v_k_end.back() << " sequences to " << v_out[i] << '\n';
+    }
+    kept_sets ks;
+    set_up_sets (ks, s_props.f_map, &traj, v_out, v_k_end);
+    return (write_output (in_fname, ks, s_props, filter_col, t_opt, r_gaps_flag, verbosity));
+}
+
+/* ---------------- replay -----------------------------------
+ * We have a trajectory from an earlier run. Read the sequences
+ * and write the survivors for each number to keep, without
+ * looking at distances. keep_list and out_list are comma
+ * separated lists of the same length. keep_list can be null if
+ * we only have a cutoff.
+ */
+static int
+replay (const char *traj_fname, const char *in_fname, const char *out_list,
+        const char *keep_list, const float cutoff, const bool ignore_len_check,
+        const bool index, const bool filter_col, const trim_opt &t_opt, const bool r_gaps_flag,
+        const short unsigned verbosity)
+{
+    trajectory traj;
+    if (read_traj (traj_fname, traj) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    vector<string> v_out;
+    vector<unsigned long> v_n;
+    split_list (out_list, v_out);
+    if (get_keep_list (keep_list, v_out, v_n) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    seq_props s_props;
+    s_props.index = index;
+    s_props.index_cols = index && filter_col;
+    int gsl_ret;
+    get_seq_list (s_props, in_fname, ignore_len_check, &gsl_ret);
+    if (gsl_ret != EXIT_SUCCESS)
+        return (bust (__func__, "error reading sequences from", in_fname, 0));
+    return (write_traj_sets (traj, s_props, in_fname, v_out, v_n, cutoff,
+                             filter_col, t_opt, r_gaps_flag, verbosity));
+}
+
+/* ---------------- dist_ckpt_key ----------------------------
+ * What the distances depend on, so a checkpoint of them from
+ * other inputs or options is not used.
+ */
+static string
+dist_ckpt_key (const char *in_fname, const char *dist_fname, const char *pd_mode,
+               const pd_opt &p_opt, const char *kmer_str, const sk_opt &k_opt, const dm_opt &d_opt)
+{
+    ostringstream o;
+    o << setprecision (9) << "dist ";
+    if (pd_mode)
+        o << "P " << p_opt.gap_diff << ' ' << file_finger (in_fname);
+    else if (kmer_str)
+        o << "K " << k_opt.k << ' ' << k_opt.sk_size << ' ' << k_opt.n_nbor << ' ' << file_finger (in_fname);
+    else
+        o << file_finger (dist_fname) << " pack " << d_opt.pack << " max " << d_opt.max_dist;
+    o << " rows " << d_opt.row_dist;
+    return o.str();
+}
+
+/* ---------------- new_row ----------------------------------
+ * A line from the file of distances to new sequences (-U).
+ */
+struct new_row {
+    string name1;   /* always a new sequence */
+    string name2;   /* old or new */
+    float dist;
+};
+
+/* ---------------- read_new_rows ----------------------------
+ * Lines are "new_name<tab>other_name<tab>distance", with names
+ * as comment lines in the alignment, starting with '>', like the
+ * sacred file. The first names are the new sequences,
+ * in the order they first appear. Distances above max_dist, if
+ * it is not negative, are dropped, as they would be from a whole
+ * matrix. d_first gets the smallest distance we keep.
+ */
+static int
+read_new_rows (const char *fname, const float max_dist, vector<new_row> &v_row,
+               vector<string> &v_new, float &d_first)
+{
+    ifstream infile (fname);
+    if (!infile)
+        return (bust (__func__, "opening", fname, ":", strerror (errno), 0));
+    unordered_set<string> seen;
+    string line;
+    size_t n_line = 0;
+    d_first = numeric_limits<float>::infinity();
+    while (mgetline (infile, line)) {
+        n_line++;
+        if (line.empty())
+            continue;
+        const size_t t1 = line.find ('\t');
+        const size_t t2 = (t1 == string::npos) ? t1 : line.find ('\t', t1 + 1);
+        new_row r;
+        size_t n = 0;
+        if (t2 == string::npos || t1 == 0 || t2 == t1 + 1)
+            return (bust (__func__, "want two names and a distance, separated by tabs, at line",
+                          to_string (n_line).c_str(), "of", fname, 0));
+        r.name1 = line.substr (0, t1);
+        r.name2 = line.substr (t1 + 1, t2 - t1 - 1);
+        try {
+            r.dist = stof (line.substr (t2 + 1), &n);
+        } catch (const std::exception &e) {
+            n = 0;
+        }
+        if (n == 0 || !(r.dist >= 0) || r.name1 == r.name2)
+            return (bust (__func__, "bad distance at line", to_string (n_line).c_str(), "of", fname, 0));
+        if (seen.insert (r.name1).second)
+            v_new.push_back (r.name1);
+        if (max_dist >= 0 && !(r.dist <= max_dist))
+            continue;
+        if (r.dist < d_first)
+            d_first = r.dist;
+        v_row.push_back (r);
     }
     return EXIT_SUCCESS;
 }
 
+/* ---------------- add_new_rows -----------------------------
+ * Read the sorted distances checkpointed in prev_dir and merge
+ * the new ones into them. New sequences are numbered after the
+ * old ones, in the order of v_new, so the result is what sorting
+ * a whole matrix with them on the end would give.
+ * A pair may come twice, but only with the same distance.
+ */
+static int
+add_new_rows (const char *prev_dir, const string &prev_key, vector<new_row> &v_row,
+              vector<string> &v_new, unique_ptr<dist_mat> &d_m_p)
+{
+    if (! ckpt_read (prev_dir, "dist.ckpt", prev_key, [&d_m_p, prev_dir] (istream &in) {
+                d_m_p.reset (new dist_mat (in, prev_dir));
+                return (d_m_p->fail() ? EXIT_FAILURE : EXIT_SUCCESS);}))
+        return (bust (__func__, "could not read distances from", prev_dir, 0));
+    const vector<string> &v_cmt = d_m_p->get_cmt_vec();
+    unordered_map<string, unsigned> ndx;
+    ndx.reserve (v_cmt.size() + v_new.size());
+    for (size_t i = v_cmt.size(); i > 0; i--)  /* first index of a name wins */
+        ndx [v_cmt[i - 1]] = unsigned (i - 1);
+    for (size_t i = 0; i < v_new.size(); i++)
+        if (! ndx.insert (make_pair (v_new[i], unsigned (v_cmt.size() + i))).second)
+            return (bust (__func__, v_new[i].c_str(), "is new, but is already in", prev_dir, 0));
+    vector<dist_entry> v_edge;
+    v_edge.reserve (v_row.size());
+    for (const new_row &r : v_row) {
+        const unordered_map<string, unsigned>::const_iterator f = ndx.find (r.name2);
+        if (f == ndx.end())
+            return (bust (__func__, "no sequence called", r.name2.c_str(), 0));
+        const unsigned i = ndx [r.name1], j = f->second;
+        v_edge.push_back ({r.dist, min (i, j), max (i, j)});
+    }
+    vector<new_row>().swap (v_row);
+    std::sort (v_edge.begin(), v_edge.end(), [] (const dist_entry &a, const dist_entry &b) {
+            return (a.ndx1 != b.ndx1 ? a.ndx1 < b.ndx1 : a.ndx2 < b.ndx2);});
+    size_t n = 0;
+    for (size_t i = 0; i < v_edge.size(); i++) {
+        if (n && v_edge[i].ndx1 == v_edge[n - 1].ndx1 && v_edge[i].ndx2 == v_edge[n - 1].ndx2) {
+            if (v_edge[i].dist != v_edge[n - 1].dist)
+                return (bust (__func__, "two different distances between",
+                              v_cmt.size() > v_edge[i].ndx1 ? v_cmt[v_edge[i].ndx1].c_str()
+                              : v_new[v_edge[i].ndx1 - v_cmt.size()].c_str(),
+                              "and", v_new[v_edge[i].ndx2 - v_cmt.size()].c_str(), 0));
+            continue;
+        }
+        v_edge[n++] = v_edge[i];
+    }
+    v_edge.resize (n);
+    return (d_m_p->add_rows (v_new, v_edge));
+}
+
+/* ---------------- key_max_dist -----------------------------
+ * Distances above max_dist may have been dropped before they
+ * were checkpointed. The last one in the key is what counts.
+ */
+static float
+key_max_dist (const string &key)
+{
+    const size_t p = key.rfind (" max ");
+    if (p == string::npos)
+        return -1.0;
+    try {
+        return (stof (key.substr (p + 5)));
+    } catch (const std::exception &e) {
+        return -1.0;
+    }
+}
+
+/* ---------------- load_prefix ------------------------------
+ * The removals checkpointed in prev_dir, up to but not including
+ * the first distance d_first to a new sequence, cannot change.
+ * They must come from the distances with key prev_key and the
+ * same choice, seeds and sacred sequences (opt_line).
+ */
+static int
+load_prefix (const char *prev_dir, const string &prev_key, const string &opt_line,
+             const float d_first, vector<traj_step> &v_prefix)
+{
+    string key;
+    if (! ckpt_key (prev_dir, "traj.ckpt", key))
+        return (bust (__func__, "no removals checkpointed in", prev_dir, 0));
+    const string head = prev_key + '\n', tail = '\n' + opt_line;
+    if (key.compare (0, head.size(), head) != 0)
+        return (bust (__func__, "removals and distances in", prev_dir, "do not match", 0));
+    if (key.size() < tail.size() || key.compare (key.size() - tail.size(), tail.size(), tail) != 0)
+        return (bust (__func__, "removals in", prev_dir, "come from a different choice,"
+                      " seeds or sacred sequences", 0));
+    trajectory traj;
+    if (! ckpt_read (prev_dir, "traj.ckpt", key,
+                     [&traj, prev_dir] (istream &in) { return get_traj (in, prev_dir, traj);}))
+        return (bust (__func__, "could not read removals from", prev_dir, 0));
+    for (size_t k = traj.n_seed; k < traj.v_step.size() && traj.v_step[k].dist < d_first; k++)
+        v_prefix.push_back (traj.v_step[k]);
+    return EXIT_SUCCESS;
+}
+
 /* ---------------- main  ------------------------------------ */
 int
 main (int argc, char *argv[])
@@ -427,31 +1872,94 @@ main (int argc, char *argv[])
     bool eflag       = false;
     bool r_gaps_flag = false;
     bool ignore_len_check = false;
+    bool one_pass    = false;
     string choice_name, seed_str;
     unsigned long seed;
     default_random_engine r_engine{};
     const char *progname = argv[0];
     const char *sacred_fname = nullptr;
     const char *plot_fname = nullptr;
+    const char *mem_str = nullptr;
+    const char *pd_mode = nullptr;
+    const char *kmer_str = nullptr;
+    const char *nbor_str = nullptr;
+    const char *cutoff_str = nullptr;
+    const char *traj_out_fname = nullptr;
+    const char *traj_in_fname = nullptr;
+    const char *hat2_out_fname = nullptr;
+    const char *bin_out_fname = nullptr;
+    const char *ens_str = nullptr;
+    const char *stem = nullptr;
+    const char *gap_str = nullptr;
+    const char *ckpt_dir = nullptr;
+    const char *prev_dir = nullptr;
+    const char *new_fname = nullptr;
+    const char *clust_fname = nullptr;
+    dm_opt d_opt;
+    pd_opt p_opt;
+    sk_opt k_opt;
+    trim_opt t_opt;
 
-    while ((c = getopt(argc, argv, "a:c:e:fgip:sv")) != -1) {
+    while ((c = getopt(argc, argv, "a:B:C:c:d:E:e:fG:gI:iK:k:L:m:N:O:o:p:P:q:R:SsT:t:U:v")) != -1) {
         switch (c) {
         case 'a':
             sacred_fname = optarg;                                     break;
+        case 'B':
+            bin_out_fname = optarg;                                    break;
+        case 'C':
+            t_opt.map_fname = optarg;                                  break;
         case 'c':
             choice_name += optarg;                                     break;
+        case 'd':
+            cutoff_str = optarg;                                       break;
+        case 'E':
+            ens_str = optarg;                                          break;
         case 'e':
             seed_str = optarg;                                         break;
         case 'f':
             filter_col = false;                                        break;
+        case 'G':
+            gap_str = optarg;                                          break;
         case 'g':
             r_gaps_flag = true;                                        break;
+        case 'I':
+            prev_dir = optarg;                                         break;
         case 'i':
             ignore_len_check = true;                                   break;
+        case 'K':
+            kmer_str = optarg;                                         break;
+        case 'k':
+            ckpt_dir = optarg;                                         break;
+        case 'L':
+            clust_fname = optarg;                                      break;
+        case 'm':
+            mem_str = optarg;                                          break;
+        case 'N':
+            nbor_str = optarg;                                         break;
+        case 'O':
+            stem = optarg;                                             break;
+        case 'o':
+            hat2_out_fname = optarg;                                   break;
         case 'p':
             plot_fname = optarg;                                       break;
+        case 'P':
+            pd_mode = optarg;                                          break;
+        case 'q':
+            if (str_to_pack (optarg, d_opt.pack) == EXIT_FAILURE) {
+                eflag = true;
+            }                                                          break;
+        case 'R':
+            traj_in_fname = optarg;                                    break;
+        case 'S':
+            one_pass = true;                                           break;
         case 's':
             seedflag = true;                                           break;
+        case 'T':
+            traj_out_fname = optarg;                                   break;
+        case 't':
+            d_opt.scratch_dir = optarg;                                break;
+        case 'U':
+            new_fname = optarg;                                        break;
         case 'v':
             verbosity++;                                               break;
         case ':':
@@ -463,6 +1971,42 @@ main (int argc, char *argv[])
 
     if (r_gaps_flag && filter_col) // column filtering has no effect if we are
         filter_col = false;        // removing gaps anyway
+    if (kmer_str) {                /* k-mers do not need an alignment */
+        ignore_len_check = true;
+        filter_col = false;
+        if (pd_mode) {
+            cerr << "Choose p-distances (-P) or k-mer distances (-K), not both\n";
+            eflag = true;
+        }
+    } else if (nbor_str) {
+        cerr << "Nearest neighbours (-N) only work with k-mer distances (-K)\n";
+        eflag = true;
+    }
+    if (nbor_str && (hat2_out_fname || bin_out_fname)) {
+        cerr << "Nearest neighbours (-N) do not give every distance, so -o and -B make no sense\n";
+        eflag = true;
+    }
+    if ((pd_mode || kmer_str) && (mem_str || d_opt.pack != PACK_NONE)) {
+        cerr << "Calculated distances (-K, -P) are kept as they are, so -m and -q make no sense\n";
+        eflag = true;
+    }
+
+    if ((gap_str || t_opt.map_fname) && ! filter_col) {
+        cerr << "Trimming columns (-G) and column maps (-C) need column filtering,"
+             << " so they do not work with -f, -g or -K\n";
+        eflag = true;
+    }
+    if (gap_str) {
+        try {
+            t_opt.max_gap = stof (gap_str);
+        } catch (const std::exception& e) {
+            t_opt.max_gap = -1.0;
+        }
+        if (t_opt.max_gap < 0 || t_opt.max_gap > 1) {
+            cerr << "The fraction of gaps for -G goes from 0 to 1, not \"" << gap_str << "\"\n";
+            eflag = true;
+        }
+    }
 
     if (filter_col && ignore_len_check) {
         cerr << "Both column filtering (-f) and ignore length check (-i)"
@@ -471,17 +2015,84 @@ main (int argc, char *argv[])
         eflag = true;
     }
 
+    if (pd_mode) {
+        if (strcmp (pd_mode, "diff") == 0) {
+            p_opt.gap_diff = true;
+        } else if (strcmp (pd_mode, "skip") != 0) {
+            cerr << "-P wants \"skip\" or \"diff\" for gaps, not \"" << pd_mode << "\"\n";
+            eflag = true;
+        }
+        if (ignore_len_check) {
+            cerr << "Distances cannot be calculated (-P) from unaligned (-i) sequences\n";
+            eflag = true;
+        }
+    }
+
+    if (traj_in_fname && (pd_mode || kmer_str || traj_out_fname || hat2_out_fname || bin_out_fname
+                          || ckpt_dir)) {
+        cerr << "Replaying a trajectory (-R) does not look at distances, so -B, -K, -k, -o, -P and -T make no sense\n";
+        eflag = true;
+    }
+
+    if (ens_str) {
+        if (choice_name.size() && choice_name != "random") {
+            cerr << "An ensemble (-E) only makes sense with random choice\n";
+            eflag = true;
+        }
+        if (traj_in_fname || traj_out_fname || hat2_out_fname || bin_out_fname || plot_fname) {
+            cerr << "An ensemble (-E) has many results, so -B, -o, -p, -R and -T make no sense\n";
+            eflag = true;
+        }
+        if (mem_str) {
+            cerr << "An ensemble (-E) shares one sorted copy of the distances, so they cannot go to scratch files (-m)\n";
+            eflag = true;
+        }
+    } else if (stem) {
+        cerr << "-O is for the output of each run of an ensemble (-E)\n";
+        eflag = true;
+    }
+
+    if (!prev_dir != !new_fname) {
+        cerr << "Adding sequences needs the earlier checkpoints (-I) and the new distances (-U)\n";
+        eflag = true;
+    } else if (prev_dir) {
+        if (ens_str || kmer_str || mem_str || pd_mode || plot_fname || d_opt.pack != PACK_NONE
+            || traj_in_fname) {
+            cerr << "Adding sequences (-I) starts from sorted distances, so -E, -K, -m, -P, -p,"
+                 << " -q and -R make no sense\n";
+            eflag = true;
+        }
+        if (choice_name == "random" || choice_name == "central") {
+            cerr << "Adding sequences (-I) changes random and central choices from the start\n";
+            eflag = true;
+        }
+        if (ckpt_dir && strcmp (ckpt_dir, prev_dir) == 0) {
+            cerr << "New checkpoints (-k) must not go over the earlier ones (-I)\n";
+            eflag = true;
+        }
+    }
+
+    if (clust_fname) {
+        if (ens_str || prev_dir || ckpt_dir || traj_in_fname || traj_out_fname) {
+            cerr << "Clusters (-L) are only known where the removal stops, so -E, -I, -k, -R and -T make no sense\n";
+            eflag = true;
+        }
+    }
+
     if (eflag)
         return (usage(progname, ""));
 
-    if ((argc - optind) < 4)
+    const bool own_dist = pd_mode || kmer_str || traj_in_fname || prev_dir;  /* no distance file */
+    if ((argc - optind) < (own_dist ? 3 : 4) - (cutoff_str ? 1 : 0))
         return (usage (progname, " too few arguments"));
     const char *in_fname           = argv[optind++];
-    const char *dist_fname         = argv[optind++];
+    const char *dist_fname         = own_dist ? in_fname : argv[optind++];
     const char *out_fname          = argv[optind++];
-    const char *to_keep_str        = argv[optind++];
+    const char *to_keep_str        = (optind < argc) ? argv[optind++] : nullptr;
 
-    unsigned long n_to_keep;
+    vector<string> v_out;
+    vector<unsigned long> v_n;
+    float cutoff = -1.0;
     if (plot_fname)
         try {
             distplot_setup (plot_fname);
@@ -490,23 +2101,130 @@ main (int argc, char *argv[])
         }
             
     try {
-        n_to_keep = stoul (to_keep_str);
         if (seed_str.length())
             seed = stoul (seed_str);
         else
             seed = DFLT_SEED;
         r_engine.seed( seed);
     } catch (const std::invalid_argument& ia) {
-        return(bust(progname, "invalid argument for num seqs: \"", to_keep_str, "\"", ia.what(), 0));
+        return(bust(progname, "invalid argument for seed: \"", seed_str.c_str(), "\"", ia.what(), 0));
+    }
+    if (cutoff_str) {
+        try {
+            cutoff = stof (cutoff_str);
+        } catch (const std::exception& e) {
+            return(bust(progname, "invalid distance cutoff: \"", cutoff_str, "\"", e.what(), 0));
+        }
+        if (cutoff < 0)
+            return(bust(progname, "distance cutoff cannot be negative", 0));
+        if (! (hat2_out_fname || bin_out_fname || traj_out_fname)) /* longer distances */
+            d_opt.max_dist = cutoff;                             /* are never needed */
     }
-    cout << progname << ": using " << in_fname << " as multiple seq alignment.\nDistance matrix from "
-         << dist_fname << "\nWriting to " << out_fname
-         << "\nKeeping " << n_to_keep << " of the sequences\n";
+    if (traj_in_fname) {
+        cout << progname << ": replaying " << traj_in_fname << " on " << in_fname << '\n';
+        return (replay (traj_in_fname, in_fname, out_fname, to_keep_str, cutoff,
+                        ignore_len_check, one_pass, filter_col, t_opt, r_gaps_flag, verbosity));
+    }
+    /* The choice, seeds and sacred sequences, which removals
+     * depend on as well as the distances and sequences. */
+    const string opt_line = string ("choice ") + (choice_name.size() ? choice_name : "first")
+        + " seed " + to_string (seed) + " s " + to_string (seedflag)
+        + " sacred " + (sacred_fname ? file_finger (sacred_fname) : string());
+    string prev_key;                 /* of the distances in prev_dir */
+    vector<new_row> v_row;
+    vector<string> v_new;
+    float d_first = numeric_limits<float>::infinity();  /* first new distance */
+    vector<traj_step> v_prefix;      /* removals the new sequences cannot change */
+    if (prev_dir) {
+        if (! ckpt_key (prev_dir, "dist.ckpt", prev_key))
+            return (bust (progname, "no distance checkpoint in", prev_dir, 0));
+        d_opt.max_dist = key_max_dist (prev_key);
+        if (d_opt.max_dist >= 0 && (cutoff < 0 || cutoff > d_opt.max_dist))
+            return (bust (progname, "distances in", prev_dir, "stop at", to_string (d_opt.max_dist).c_str(),
+                          "so give a cutoff (-d) which is not bigger", 0));
+        if (d_opt.max_dist >= 0 && (hat2_out_fname || bin_out_fname))
+            return (bust (progname, "distances in", prev_dir, "stop at a cutoff, so -o and -B cannot"
+                          " write every distance", 0));
+        if (read_new_rows (new_fname, d_opt.max_dist, v_row, v_new, d_first) != EXIT_SUCCESS
+            || load_prefix (prev_dir, prev_key, opt_line, d_first, v_prefix) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    split_list (out_fname, v_out);
+    if (get_keep_list (to_keep_str, v_out, v_n) != EXIT_SUCCESS)
+        return (usage (progname, " bad list of outputs or numbers to keep"));
+    const unsigned long n_to_keep = *min_element (v_n.begin(), v_n.end());
+    const bool multi = v_n.size() > 1;
+    unsigned n_run = 0;
+    if (ens_str) {
+        try {
+            n_run = unsigned (stoul (ens_str));
+        } catch (const std::exception& e) {
+            return(bust(progname, "invalid number of runs: \"", ens_str, "\"", e.what(), 0));
+        }
+        if (n_run == 0 || multi)
+            return (usage (progname, " an ensemble needs at least one run and one number to keep"));
+    }
+    if (multi && (hat2_out_fname || bin_out_fname))
+        return (usage (progname, " -o and -B only work with one output file"));
+    if (multi && clust_fname && choice_name == "central")
+        return (usage (progname, " medoids of clusters (-L -c central) only work with one output file"));
+    if (mem_str) {
+        double mem_mb = 0.0;
+        try {
+            mem_mb = stod (mem_str);
+        } catch (const std::exception& e) {
+            return(bust(progname, "invalid memory size: \"", mem_str, "\"", e.what(), 0));
+        }
+        if (!(mem_mb > 0) || mem_mb * 1024 * 1024 >= double (numeric_limits<size_t>::max()))
+            return(bust(progname, "memory size (-m) must be more than zero and less than the address space, not \"", mem_str, "\"", 0));
+        d_opt.mem_budget = size_t (mem_mb * 1024 * 1024);
+    }
+    try {
+        if (kmer_str)
+            k_opt.k = unsigned (stoul (kmer_str));
+        if (nbor_str)
+            k_opt.n_nbor = unsigned (stoul (nbor_str));
+    } catch (const std::invalid_argument& ia) {
+        return(bust(progname, "invalid k-mer length or number of neighbours", ia.what(), 0));
+    }
+    cout << progname << ": using " << in_fname << " as multiple seq alignment.\n";
+    if (prev_dir)
+        cout << "Distances from " << prev_dir << ", adding " << v_new.size()
+             << " sequences from " << new_fname;
+    else
+        cout << (pd_mode ? "p-distances calculated from " :
+                 (kmer_str ? "k-mer distances calculated from " : "Distance matrix from "))
+             << dist_fname;
+    cout << "\nWriting to " << out_fname << '\n';
+    if (to_keep_str)
+        cout << "Keeping " << to_keep_str << " of the sequences\n";
+    if (cutoff_str)
+        cout << "Removing one of each pair closer than " << cutoff << '\n';
     if (plot_fname)
         cout << "Writing a plot file to "<< plot_fname << "\n";
+    if (n_run)
+        cout << n_run << " runs with random choice, starting from seed " << seed << '\n';
     struct seq_props s_props;
-    int gsl_ret;
-    thread gsl_thr (get_seq_list, ref(s_props), in_fname, ignore_len_check, &gsl_ret);
+    s_props.index = one_pass;
+    s_props.index_cols = one_pass && filter_col;
+    int gsl_ret = EXIT_SUCCESS;
+    string props_key;
+    bool props_saved = false;        /* there is a checkpoint of s_props */
+    if (ckpt_dir) {
+        props_key = "props " + file_finger (in_fname) + " i " + to_string (ignore_len_check)
+            + " S " + to_string (s_props.index) + to_string (s_props.index_cols);
+        props_saved = ckpt_read (ckpt_dir, "props.ckpt", props_key,
+                                 [&s_props] (istream &in) { return load_props (in, s_props);});
+        if (props_saved) {
+            cout << "Sequence properties from checkpoint in " << ckpt_dir << '\n';
+        } else {
+            s_props.f_map.clear();
+            s_props.rec.clear();
+        }
+    }
+    thread gsl_thr;
+    if (! props_saved)
+        gsl_thr = thread (get_seq_list, ref(s_props), in_fname, ignore_len_check, &gsl_ret);
 
     vector<string> v_sacred;
     int sacred_ret = EXIT_SUCCESS;
@@ -518,29 +2236,139 @@ main (int argc, char *argv[])
 
     if (choice_name.size()) {
         if ((choice = set_up_choice(choice_name)) == nullptr) {
-            gsl_thr.join();
-            sac_thr.join();
+            if (gsl_thr.joinable())
+                gsl_thr.join();
+            if (sac_thr.joinable())
+                sac_thr.join();
             return EXIT_FAILURE;
         }
     }
 
-    vector<dist_entry> v_dist; /* Big vector with sorted distance entries */
-    vector<string> v_cmt;
+    const bool central = (choice == decide_central);  /* needs whole rows */
+    d_opt.row_dist = central;
+
+    /* The removals only depend on the distances, sequences, choice,
+     * seeds and sacred sequences. They can be used from a checkpoint
+     * unless we need distances or a plot as well. */
+    const bool ckpt_traj = ckpt_dir && ! n_run && ! hat2_out_fname && ! bin_out_fname && ! plot_fname;
+    string dm_key, traj_key;
+    if (ckpt_dir) {
+        if (prev_dir) {
+            ostringstream o;
+            o << setprecision (9) << "incr\n" << prev_key << "\nnew " << file_finger (new_fname)
+              << " max " << d_opt.max_dist;
+            dm_key = o.str();
+        } else {
+            dm_key = dist_ckpt_key (in_fname, dist_fname, pd_mode, p_opt, kmer_str, k_opt, d_opt);
+        }
+        traj_key = dm_key + '\n' + props_key + '\n' + opt_line;
+    }
+    if (ckpt_traj) {
+        trajectory traj;
+        if (ckpt_read (ckpt_dir, "traj.ckpt", traj_key,
+                       [&traj, ckpt_dir] (istream &in) { return get_traj (in, ckpt_dir, traj);})) {
+            cout << "Removals from checkpoint in " << ckpt_dir << '\n';
+            if (gsl_thr.joinable())
+                gsl_thr.join();
+            if (sac_thr.joinable())
+                sac_thr.join();
+            if (gsl_ret != EXIT_SUCCESS)
+                return (bust(progname, "error in get_seq_list", 0));
+            if (traj_out_fname) {
+                if (write_traj (traj_out_fname, traj) != EXIT_SUCCESS)
+                    return (bust (progname, "error writing trajectory", 0));
+                cout << "Wrote " << traj.v_step.size() << " removals to " << traj_out_fname << '\n';
+            }
+            return (write_traj_sets (traj, s_props, in_fname, v_out, v_n, cutoff,
+                                     filter_col, t_opt, r_gaps_flag, verbosity));
+        }
+    }
 
-    if ( read_distmat (dist_fname, v_dist, v_cmt) == EXIT_FAILURE) {
+    unique_ptr<dist_mat> d_m_p; /* Big set of distance entries, sorted lazily */
+    bool dm_saved = false;      /* there is a checkpoint of d_m */
+    if (ckpt_dir) {
+        dm_saved = ckpt_read (ckpt_dir, "dist.ckpt", dm_key, [&d_m_p, ckpt_dir] (istream &in) {
+                d_m_p.reset (new dist_mat (in, ckpt_dir));
+                return (d_m_p->fail() ? EXIT_FAILURE : EXIT_SUCCESS);});
+        if (! dm_saved)
+            d_m_p.reset();
+    }
+    if (dm_saved) {
+        cout << "Sorted distances from checkpoint in " << ckpt_dir << '\n';
+    } else if (pd_mode) {
+        vector<string> v_pd_cmt;
+        vector<float> v_tri;
+        if (msa_pdist (in_fname, p_opt, v_pd_cmt, v_tri) == EXIT_SUCCESS)
+            d_m_p.reset (new dist_mat (v_pd_cmt, v_tri, central));
+    } else if (kmer_str && k_opt.n_nbor) {
+        vector<string> v_sk_cmt;
+        vector<dist_entry> v_edge;
+        if (sketch_nbor (in_fname, k_opt, v_sk_cmt, v_edge) == EXIT_SUCCESS)
+            d_m_p.reset (new dist_mat (v_sk_cmt, v_edge));
+    } else if (kmer_str) {
+        vector<string> v_sk_cmt;
+        vector<float> v_tri;
+        if (sketch_dist (in_fname, k_opt, v_sk_cmt, v_tri) == EXIT_SUCCESS)
+            d_m_p.reset (new dist_mat (v_sk_cmt, v_tri, central));
+    } else if (prev_dir) {
+        if (add_new_rows (prev_dir, prev_key, v_row, v_new, d_m_p) != EXIT_SUCCESS)
+            d_m_p.reset();
+    } else {
+        d_m_p.reset (new dist_mat (dist_fname, d_opt));
+    }
+
+    if (!d_m_p || d_m_p->fail()) {
         cerr << "Waiting on some threads to finish\n";
-        return (EXIT_FAILURE);
-        gsl_thr.join(); sac_thr.join();
-        return (bust(progname, "error reading distance matrix", 0));
+        if (gsl_thr.joinable())
+            gsl_thr.join();
+        if (sac_thr.joinable())
+            sac_thr.join();
+        return (bust(progname, "error getting distance matrix", 0));
     }
-    if (verbosity > 0)
+    dist_mat &d_m = *d_m_p;
+    if (central && ! d_m.has_rows()) {
+        if (gsl_thr.joinable())
+            gsl_thr.join();
+        if (sac_thr.joinable())
+            sac_thr.join();
+        return (bust(progname, "central choice needs every distance, so does not work with -N", 0));
+    }
+    if (d_m.is_sparse() && (hat2_out_fname || bin_out_fname)) {
+        if (gsl_thr.joinable())
+            gsl_thr.join();
+        if (sac_thr.joinable())
+            sac_thr.join();
+        return (bust(progname, "some pairs have no distance, so -o and -B cannot write every distance", 0));
+    }
+    const vector<string> &v_cmt = d_m.get_cmt_vec();
+    if (verbosity > 0) {
         cout << "Finished reading distance matrix\n";
-    gsl_thr.join();
+        if (d_m.on_disk())
+            cout << "Distances did not fit in memory, sorted in " << d_opt.scratch_dir << '\n';
+    }
+    if (d_m.get_pack() != PACK_NONE)
+        cout << "Distances packed to 16 bits, biggest error " << d_m.get_q_err() << '\n';
+    if (ckpt_dir && ! dm_saved) {
+        if (d_m.on_disk())
+            cout << "Distances are in scratch files, so they are not checkpointed\n";
+        else if (d_m.sort_all() != EXIT_SUCCESS
+                 || ckpt_write (ckpt_dir, "dist.ckpt", dm_key,
+                                [&d_m] (ostream &out) { return d_m.save (out);}) != EXIT_SUCCESS)
+            cerr << progname << ": could not checkpoint distances, carrying on\n";
+        else if (verbosity > 0)
+            cout << "Checkpointed sorted distances in " << ckpt_dir << '\n';
+    }
+    if (gsl_thr.joinable())
+        gsl_thr.join();
     if (gsl_ret != EXIT_SUCCESS) {
         if (sacred_fname)
             sac_thr.join();
         return (bust(progname, "error in get_seq_list", 0));
     }
+    if (ckpt_dir && ! props_saved)
+        if (ckpt_write (ckpt_dir, "props.ckpt", props_key,
+                        [&s_props] (ostream &out) { return save_props (out, s_props);}) != EXIT_SUCCESS)
+            cerr << progname << ": could not checkpoint sequence properties, carrying on\n";
     if (verbosity > 1)
         cout << "get_seq_list thread finished\n";
     if (check_lists (s_props.f_map, v_cmt) == EXIT_FAILURE) {
@@ -549,8 +2377,11 @@ main (int argc, char *argv[])
             sac_thr.join();
         return(bust(progname, "distmat file: \"", dist_fname, o, in_fname, 0));
     }
+    trajectory traj;                  /* several outputs come from one trajectory */
+    trajectory *traj_p = (traj_out_fname || multi || ckpt_traj || prev_dir) ? &traj : nullptr;
+    traj.n0 = s_props.f_map.size();
     if (seedflag)
-        remove_seeds (s_props.f_map, v_cmt);
+        remove_seeds (s_props.f_map, v_cmt, traj_p);
     if (sacred_fname) {
         sac_thr.join();
         if (sacred_ret != EXIT_SUCCESS)
@@ -559,18 +2390,56 @@ main (int argc, char *argv[])
             return EXIT_FAILURE;
     }
 
-    remove_seq (s_props.f_map, v_cmt, v_dist, n_to_keep, choice, r_engine);
-    distplot_close();
-    vector<bool> v_used;
-    if (filter_col) {
-        v_used.assign (s_props.len, false);
-        find_used_columns (in_fname, s_props.f_map, v_used, verbosity);
+    if (n_run)
+        return (run_ensemble (s_props, d_m, n_to_keep, cutoff, n_run, seed, out_fname, stem,
+                              in_fname, filter_col, t_opt, r_gaps_flag, verbosity));
+    if (clust_fname) {
+        if (cluster_seq (s_props.f_map, d_m, n_to_keep, cutoff, choice, r_engine, traj_p,
+                         clust_fname) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    } else if (prev_dir) {
+        for (const traj_step &t : v_prefix)
+            if (! s_props.f_map.count (t.name))
+                return (bust (progname, t.name.c_str(), "was removed before, but is not in", in_fname, 0));
+        const size_t start = d_m.first_from (d_first);
+        cout << "Keeping " << v_prefix.size() << " removals from " << prev_dir << ", starting again at "
+             << start << " of " << d_m.n_edge() << " distances\n";
+        if (remove_seq (s_props.f_map, d_m, 0, -1.0, choice, r_engine, traj_p,
+                        start, &v_prefix) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    } else if (traj_out_fname || ckpt_traj) {  /* go to the end, so any n_to_keep can use it */
+        if (remove_seq (s_props.f_map, d_m, 0, -1.0, choice, r_engine, traj_p) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
     } else {
-        v_used.resize(0);
+        if (remove_seq (s_props.f_map, d_m, n_to_keep, cutoff, choice, r_engine, traj_p) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
     }
-
-    if (write_kept_seq (in_fname, out_fname, s_props.f_map, v_used, r_gaps_flag) != EXIT_SUCCESS)
-        return EXIT_FAILURE;
-
-    return EXIT_SUCCESS;
+    distplot_close();
+    if (ckpt_traj)
+        if (ckpt_write (ckpt_dir, "traj.ckpt", traj_key,
+                        [&traj] (ostream &out) { put_traj (out, traj); return EXIT_SUCCESS;}) != EXIT_SUCCESS)
+            cerr << progname << ": could not checkpoint removals, carrying on\n";
+    vector<size_t> v_k_end (v_n.size(), 0);
+    if (traj_p)
+        for (size_t i = 0; i < v_n.size(); i++)
+            v_k_end[i] = traj_n_remove (traj, v_n[i], cutoff);
+    if (hat2_out_fname || bin_out_fname) {
+        map<string, fseq_prop> kept = s_props.f_map;
+        if (traj_p)
+            for (size_t k = traj.n_seed; k < v_k_end[0]; k++)
+                kept.erase (traj.v_step[k].name);
+        if (write_kept_dist (d_m, kept, hat2_out_fname, bin_out_fname) != EXIT_SUCCESS)
+            return (bust (progname, "error writing distances of kept sequences", 0));
+    }
+    if (traj_out_fname) {
+        if (write_traj (traj_out_fname, traj) != EXIT_SUCCESS)
+            return (bust (progname, "error writing trajectory", 0));
+        cout << "Wrote " << traj.v_step.size() << " removals to " << traj_out_fname << '\n';
+    }
+    if (multi)
+        for (size_t i = 0; i < v_n.size(); i++)
+            cout << "Writing " << traj.n0 - v_k_end[i] << " sequences to " << v_out[i] << '\n';
+    kept_sets ks;
+    set_up_sets (ks, s_props.f_map, traj_p, v_out, v_k_end);
+    return (write_output (in_fname, ks, s_props, filter_col, t_opt, r_gaps_flag, verbosity));
 }
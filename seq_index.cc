@@ -5,6 +5,7 @@
  * For each sequence, get an index into the file (tellg) for each sequence.
  */
 
+#include <cstdint>
 #include <cstring>
 #include <cerrno>
 #include <fstream>
@@ -0,0 +1,77 @@
+/*
+ * 19 Oct 2026
+ * Fill the upper triangle of distances between every pair of
+ * nseq sequences, given a function for one pair. The triangle is
+ * cut into square tiles, which are handed out to threads by an
+ * atomic counter. Each pair has its own slot in the output, so
+ * the threads do not have to talk to each other.
+ * Can only be included after <algorithm>, <atomic>, <thread>,
+ * <vector> and distmat_rd.hh
+ */
+#ifndef TILE_DIST_HH
+#define TILE_DIST_HH
+
+static const unsigned TILE = 64;     /* sequences per side of a tile */
+
+struct tile {
+    unsigned b1, b2;                 /* block numbers, b1 <= b2 */
+};
+
+/* ---------------- get_n_thread -----------------------------
+ * Zero means ask the machine how many it has.
+ */
+inline unsigned
+get_n_thread (const unsigned n)
+{
+    if (n)
+        return n;
+    const unsigned hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+}
+
+/* ---------------- tile_worker ------------------------------
+ * Keep taking tiles until there are none left.
+ */
+template <typename F>
+void
+tile_worker (const unsigned nseq, const std::vector<tile> &v_tile,
+             std::atomic<size_t> &next, const F &pair_dist, std::vector<float> &v_tri)
+{
+    for (size_t t = next++; t < v_tile.size(); t = next++) {
+        const unsigned i_end = std::min (nseq, (v_tile[t].b1 + 1) * TILE);
+        const unsigned j_end = std::min (nseq, (v_tile[t].b2 + 1) * TILE);
+        for (unsigned i = v_tile[t].b1 * TILE; i < i_end; i++) {
+            unsigned j = v_tile[t].b2 * TILE;
+            if (j <= i)
+                j = i + 1;
+            for ( ; j < j_end; j++)
+                v_tri [tri_ndx (i, j, nseq)] = pair_dist (i, j);
+        }
+    }
+}
+
+/* ---------------- tile_dist --------------------------------
+ * pair_dist (i, j) gives the distance for i < j. v_tri must
+ * already have room for every pair.
+ */
+template <typename F>
+void
+tile_dist (const unsigned nseq, const unsigned n_thread, const F &pair_dist,
+           std::vector<float> &v_tri)
+{
+    std::vector<tile> v_tile;
+    const unsigned n_blk = (nseq + TILE - 1) / TILE;
+    for (unsigned b1 = 0; b1 < n_blk; b1++)
+        for (unsigned b2 = b1; b2 < n_blk; b2++)
+            v_tile.push_back ({b1, b2});
+
+    std::atomic<size_t> next (0);
+    std::vector<std::thread> v_thr;
+    for (unsigned t = 0; t < get_n_thread (n_thread); t++)
+        v_thr.push_back (std::thread (tile_worker<F>, nseq, std::cref (v_tile), std::ref (next),
+                                      std::cref (pair_dist), std::ref (v_tri)));
+    for (std::thread &t : v_thr)
+        t.join();
+}
+
+#endif /* TILE_DIST_HH */
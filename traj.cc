@@ -0,0 +1,119 @@
+/*
+ * 19 Oct 2026
+ * Write and read reduce trajectories. The file is
+ *   - eight bytes "RDTRAJ1\n"
+ *   - n0, n_seed and the number of steps as 64 bit integers
+ *   - each step as a 32 bit float distance, a 32 bit name length
+ *     and the name
+ * all in the machine's byte order.
+ * Greedy removal is nested. Whatever we stop at, the sequences
+ * removed are a prefix of the full trajectory, so one file gives
+ * the survivors for any number to keep or distance cutoff.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bust.hh"
+#include "traj.hh"
+
+using namespace std;
+
+/* ---------------- structures and constants ----------------- */
+static const char TRAJ_MAGIC[8] = {'R', 'D', 'T', 'R', 'A', 'J', '1', '\n'};
+static const uint32_t MAX_NAME_LEN = 1 << 20;
+
+/* ---------------- put_traj ---------------------------------
+ * Write a trajectory to a stream which is already open, so it
+ * can go in the middle of something bigger.
+ */
+void
+put_traj (ostream &outfile, const trajectory &traj)
+{
+    const uint64_t head[3] = {traj.n0, traj.n_seed, traj.v_step.size()};
+    outfile.write (TRAJ_MAGIC, sizeof (TRAJ_MAGIC));
+    outfile.write ((const char *) head, sizeof (head));
+    for (const traj_step &t : traj.v_step) {
+        const uint32_t len = uint32_t (t.name.size());
+        outfile.write ((const char *) &t.dist, sizeof (t.dist));
+        outfile.write ((const char *) &len, sizeof (len));
+        outfile.write (t.name.data(), len);
+    }
+}
+
+/* ---------------- write_traj ------------------------------- */
+int
+write_traj (const char *fname, const trajectory &traj)
+{
+    ofstream outfile (fname, ios::binary);
+    if (!outfile)
+        return (bust (__func__, "Open fail for writing on", fname, ": ", strerror(errno), 0));
+    put_traj (outfile, traj);
+    outfile.close();
+    if (outfile.fail())
+        return (bust (__func__, "Error writing to", fname, 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- get_traj ---------------------------------
+ * Read a trajectory from an open stream. fname is only for
+ * complaining.
+ */
+int
+get_traj (istream &infile, const char *fname, trajectory &traj)
+{
+    char magic [sizeof (TRAJ_MAGIC)];
+    uint64_t head[3];
+    infile.read (magic, sizeof (magic));
+    infile.read ((char *) head, sizeof (head));
+    if (!infile || memcmp (magic, TRAJ_MAGIC, sizeof (magic)) != 0)
+        return (bust (__func__, fname, "is not a reduce trajectory", 0));
+    if (head[1] > head[2] || head[2] > head[0])
+        return (bust (__func__, "nonsense header in", fname, 0));
+    traj.n0 = head[0];
+    traj.n_seed = head[1];
+    traj.v_step.resize (head[2]);
+    for (traj_step &t : traj.v_step) {
+        uint32_t len = 0;
+        infile.read ((char *) &t.dist, sizeof (t.dist));
+        infile.read ((char *) &len, sizeof (len));
+        if (!infile || len > MAX_NAME_LEN)
+            return (bust (__func__, "broken step in", fname, 0));
+        t.name.resize (len);
+        infile.read (&t.name[0], len);
+    }
+    if (!infile)
+        return (bust (__func__, "file ends early:", fname, 0));
+    return EXIT_SUCCESS;
+}
+
+/* ---------------- read_traj -------------------------------- */
+int
+read_traj (const char *fname, trajectory &traj)
+{
+    ifstream infile (fname, ios::binary);
+    if (!infile)
+        return (bust (__func__, "opening", fname, ":", strerror(errno), 0));
+    return (get_traj (infile, fname, traj));
+}
+
+/* ---------------- traj_n_remove ----------------------------
+ * How many steps would a run which stops at to_keep sequences,
+ * or at the first distance not below cutoff (if not negative),
+ * have taken ? Seeds always go.
+ */
+size_t
+traj_n_remove (const trajectory &traj, const unsigned long to_keep, const float cutoff)
+{
+    size_t k = traj.n_seed;
+    size_t n_alive = traj.n0 - traj.n_seed;
+    for ( ; k < traj.v_step.size() && n_alive > to_keep; k++, n_alive--)
+        if (cutoff >= 0 && !(traj.v_step[k].dist < cutoff))
+            break;
+    return k;
+}
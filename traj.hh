@@ -0,0 +1,34 @@
+/*
+ * 19 Oct 2026
+ * The order in which reduce removed sequences.
+ * Can only be included after <istream>, <ostream>, <string> and <vector>
+ */
+#ifndef TRAJ_HH
+#define TRAJ_HH
+
+/* ---------------- trajectory -------------------------------
+ * n0 is the number of sequences we started with. The first
+ * n_seed steps are seeds, which are always removed before
+ * anything else. The rest are in the order of removal, with the
+ * distance of the pair which caused it, so distances never go
+ * down.
+ */
+struct traj_step {
+    std::string name;
+    float dist;
+};
+
+struct trajectory {
+    size_t n0;
+    size_t n_seed;
+    std::vector<traj_step> v_step;
+    trajectory () : n0 (0), n_seed (0) {}
+};
+
+void put_traj (std::ostream &outfile, const trajectory &traj);
+int write_traj (const char *fname, const trajectory &traj);
+int get_traj (std::istream &infile, const char *fname, trajectory &traj);
+int read_traj (const char *fname, trajectory &traj);
+size_t traj_n_remove (const trajectory &traj, const unsigned long to_keep, const float cutoff);
+
+#endif /* TRAJ_HH */